@@ -5,20 +5,96 @@
 #include <random>
 #include <cmath>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <array>
 
 #include <thread>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <sstream>
+#include <map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 #define INFINITY 100000
 #define DEFAULT_DEPTH 3
 #define KING_VALUE 150
 #define MAN_VALUE 100
-
-#define TIME std::chrono::system_clock::time_point
-#define NOW chrono::system_clock::now()
+#define CENTER_VALUE 1
+// Below this many pieces the kings are brought to the center
+#define ENDGAME_PIECES 15
+#define TT_MEGABYTES 32
+#define MAX_PLY 64
+#define ASPIRATION_WINDOW 8
+// Wider than any score, game over scores included
+#define FULL_WINDOW (INFINITY + MAX_PLY)
+// Endgame tables : file mapped at startup, pieces built by default, and
+// the score of a won position, minus its distance to the win
+#define TB_FILE "checkers.tb"
+#define TB_PIECES 4
+#define TB_WIN (INFINITY / 2)
+// Opening book : file mapped at startup, and plies of each game kept by
+// the builder
+#define BOOK_FILE "checkers.book"
+#define BOOK_PLIES 16
+// Self-play matches : random plies before the engines play, plies before
+// a draw, and ms before a silent engine loses
+#define MATCH_OPENING_PLIES 6
+#define MATCH_MAX_PLIES 200
+#define MATCH_MOVE_TIMEOUT 5000
+// Server : table of each game, in MB
+#define SERVER_TT_MEGABYTES 8
+
+// Time allowed for one move and the part of it kept for the answer, in ms
+#define MOVE_BUDGET 100
+#define TIME_MARGIN 3
+// Nodes searched between two looks at the clock, a power of two
+#define TIME_CHECK_NODES 1024
 
 #define ALPHABETA
 #define PROGRESSIVE_DEEPENING
+// Search the replies of the opponent while it thinks
+#define PONDER
+// Forced captures are played out past the nominal depth
+#define QUIESCENCE
+// Capture chains taking the same pieces to the same square are searched once
+#define UNIQUE_CAPTURES
+// Quiet moves ordered late are searched LMR_REDUCTION plies shallower from
+// LMR_DEPTH on, once LMR_MOVES moves have been searched in full, and again
+// in full if they beat alpha
+#define LATE_MOVE_REDUCTIONS
+#define LMR_DEPTH 3
+#define LMR_MOVES 3
+#define LMR_REDUCTION 1
+// Without a capture to play, a zero window node too far below alpha is cut
+// one ply from the leaves, and searched one ply shallower two plies from
+// them. Margins are in hundredths of a man, whose value depends on the
+// material left.
+#define FUTILITY
+#define FUTILITY_MARGIN 100
+#define RAZOR_MARGIN 250
+
+// Parallel search : Lazy SMP helpers by default, or the root moves split
+// over a worker pool
+//#define ROOT_SPLIT
 
 //#define TESTING_BOARD
 
@@ -28,21 +104,275 @@ class Game;
 class Position;
 class Board;
 class Move;
-class Atom;
 class Square;
+class SearchState;
 
-int minimax(Position currentPosition, int depth);
-int alphabeta(Position currentPosition, int depth, int a, int b);
+int minimax(Position & currentPosition, int depth, SearchState & state);
+int alphabeta(Position & currentPosition, int depth, int a, int b, SearchState & state, int ply);
+int quiescence(Position & currentPosition, int a, int b, SearchState & state, int ply);
 char oppositeColor(char c);
 
-TIME start;
 
 
-struct moveScoreType {
-    string move;
-    int score;
+// Search clock of a game. The search polls it every TIME_CHECK_NODES nodes
+// and returns as soon as the stop flag is set, the scores it brings back
+// are then meaningless and must be thrown away.
+class TimeManager {
+    
+private:
+    
+    chrono::steady_clock::time_point _start;
+    double _budget;
+    double _margin;
+    bool _pondering;
+    atomic<bool> _stop;
+    // nodes allowed for a move, 0 for no limit, and nodes counted so far
+    long long _nodeLimit;
+    atomic<long long> _nodes;
+    
+public:
+    
+    TimeManager(double budget = MOVE_BUDGET, double margin = TIME_MARGIN) : _budget(budget), _margin(margin), _pondering(false), _stop(false), _nodeLimit(0), _nodes(0) {
+        start();
+    }
+    
+    void setBudget(double budget, double margin) {
+        _budget = budget;
+        _margin = margin;
+    }
+    
+    void setNodeLimit(long long nodes) {
+        _nodeLimit = nodes;
+    }
+    
+    // New move : the clock restarts and the flag is cleared
+    void start() {
+        _start = chrono::steady_clock::now();
+        _pondering = false;
+        _nodes = 0;
+        _stop = false;
+    }
+    
+    // Search without a limit, until stop is called
+    void ponder() {
+        start();
+        _pondering = true;
+    }
+    
+    // Milliseconds since start
+    double elapsed() const {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - _start).count();
+    }
+    
+    double limit() const {
+        return _budget - _margin;
+    }
+    
+    void stop() {
+        _stop.store(true, memory_order_relaxed);
+    }
+    
+    bool stopped() const {
+        return _stop.load(memory_order_relaxed);
+    }
+    
+    // Called at every node, only reads the clock and adds to the node
+    // count every TIME_CHECK_NODES calls of the same thread
+    bool poll() {
+        thread_local unsigned int nodes = 0;
+        if ((++nodes & (TIME_CHECK_NODES - 1)) == 0 && !_pondering) {
+            bool outOfNodes = _nodeLimit && (_nodes += TIME_CHECK_NODES) >= _nodeLimit;
+            if (outOfNodes || elapsed() > limit()) {
+                stop();
+            }
+        }
+        return stopped();
+    }
+    
+    // Whether an iteration expected to last expectedTime ms ends in time
+    bool startIteration(double expectedTime) const {
+        return !stopped() && elapsed() + expectedTime <= limit();
+    }
+};
+
+
+// A finished iteration : its depth, the ms and nodes used since the start
+struct iterationStatsType {
+    int depth;
+    double ms;
+    long long nodes;
+};
+
+
+
+// Bitboards : one bit per playable square, bit i is the square of index i
+typedef uint32_t Bitboard;
+
+#define ROW_0 0x0000000Fu
+#define ROW_7 0xF0000000u
+
+// Directions : 0 = (i-1, j-1), 1 = (i-1, j+1), 2 = (i+1, j-1), 3 = (i+1, j+1).
+// The opposite of dir is 3 - dir.
+#define DIR_DOWN 0
+#define DIR_UP 1
+
+// A one-step shift depends on the parity of the row. The masks keep only
+// the squares that have a neighbor in that direction.
+const Bitboard EVEN_MASK[4] = {0x0E0E0E00u, 0x0F0F0F00u, 0x0E0E0E0Eu, 0x0F0F0F0Fu};
+const int EVEN_SHIFT[4] = {-5, -4, 3, 4};
+const Bitboard ODD_MASK[4] = {0xF0F0F0F0u, 0x70707070u, 0x00F0F0F0u, 0x00707070u};
+const int ODD_SHIFT[4] = {-4, -3, 4, 5};
+
+inline Bitboard shift(Bitboard b, int s) {
+    return (s > 0) ? (b << s) : (b >> -s);
+}
+
+inline Bitboard neighbors(Bitboard b, int dir) {
+    return shift(b & EVEN_MASK[dir], EVEN_SHIFT[dir]) | shift(b & ODD_MASK[dir], ODD_SHIFT[dir]);
+}
+
+// Neighbor and landing square of a square in each direction, as bits, 0
+// past the edge of the board. The captured piece stands on the neighbor.
+struct squareTablesType {
+    Bitboard neighbor[32][4];
+    Bitboard landing[32][4];
+};
+
+constexpr squareTablesType makeSquareTables() {
+    squareTablesType tables = {};
+    for (int index = 0; index < 32; ++index) {
+        int i = index / 4;
+        int j = 2 * (index % 4) + i % 2;
+        for (int dir = 0; dir < 4; ++dir) {
+            int di = (dir < 2) ? -1 : 1;
+            int dj = (dir % 2) ? 1 : -1;
+            for (int step = 1; step <= 2; ++step) {
+                int ni = i + step * di, nj = j + step * dj;
+                Bitboard bit = (ni < 0 || ni > 7 || nj < 0 || nj > 7) ? 0 : 1u << (4 * ni + nj / 2);
+                (step == 1 ? tables.neighbor : tables.landing)[index][dir] = bit;
+            }
+        }
+    }
+    return tables;
+}
+
+constexpr squareTablesType SQUARE_TABLES = makeSquareTables();
+
+// Directions a piece moves in, one bit per direction : red men, black men
+// and kings
+constexpr int RED_MAN_DIRECTIONS = 0x3;
+constexpr int BLACK_MAN_DIRECTIONS = 0xC;
+constexpr int KING_DIRECTIONS = 0xF;
+
+inline int lsb(Bitboard b) {
+    return __builtin_ctz(b);
+}
+
+inline int popLsb(Bitboard & b) {
+    int index = __builtin_ctz(b);
+    b &= b - 1;
+    return index;
+}
+
+inline int popCount(Bitboard b) {
+    return __builtin_popcount(b);
+}
+
+// Square jumped over between fr and to, rows of odd parity round up
+inline int middle(int fr, int to) {
+    return (fr + to + ((fr >> 2) & 1)) >> 1;
+}
+
+// What Board::play needs to take a move back
+struct undoType {
+    Bitboard captured;
+    Bitboard capturedKings;
+    bool crowned;
+    uint64_t hash;
+    int kingsCenter;
+};
+
+
+
+// Zobrist keys : one per piece type and square, plus one for black to move.
+// Piece types are r, R, b, B in that order, see pieceIndex.
+struct zobristType {
+    uint64_t pieces[4][32];
+    uint64_t blackToMove;
+};
+
+inline uint64_t splitmix64(uint64_t & state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+zobristType makeZobrist() {
+    zobristType keys;
+    uint64_t state = 20240611;
+    for (int piece = 0; piece < 4; ++piece) {
+        for (int square = 0; square < 32; ++square) {
+            keys.pieces[piece][square] = splitmix64(state);
+        }
+    }
+    keys.blackToMove = splitmix64(state);
+    return keys;
+}
+
+const zobristType ZOBRIST = makeZobrist();
+
+
+// Distance of each square to the center of the board, in half squares,
+// used to bring the kings to the center in endgames
+constexpr array<int, 32> makeCenterDistance() {
+    array<int, 32> distance = {};
+    for (int index = 0; index < 32; ++index) {
+        int i = index / 4;
+        int j = 2 * (index % 4) + i % 2;
+        int di = (2*i > 7) ? 2*i - 7 : 7 - 2*i;
+        int dj = (2*j > 7) ? 2*j - 7 : 7 - 2*j;
+        distance[index] = max(di, dj);
+    }
+    return distance;
+}
+
+constexpr array<int, 32> CENTER_DISTANCE = makeCenterDistance();
+
+// Center distance of the kings of b
+inline int centerDistance(Bitboard b) {
+    int sum = 0;
+    while (b) {
+        sum += CENTER_DISTANCE[popLsb(b)];
+    }
+    return sum;
+}
+
+
+// Evaluation weights, the tune mode prints better ones
+struct weightsType {
+    int man;
+    int king;
+    int center;
 };
 
+weightsType WEIGHTS = {MAN_VALUE, KING_VALUE, CENTER_VALUE};
+
+// The evaluation for red, from the material differences, the center term
+// of the kings and the number of pieces left. Board and the batch
+// evaluator both use it.
+inline int evaluation(const weightsType & w, int men, int kings, int center, int material) {
+    int value = w.man * men + w.king * kings;
+    if (material < ENDGAME_PIECES) {
+        value += w.center * center;
+    }
+    return value / material;
+}
+
+inline int pieceIndex(bool red, bool king) {
+    return 2*!red + king;
+}
+
 
 
 class Square {
@@ -55,6 +385,12 @@ private:
     
 public:
     
+    Square() {}
+    
+    Square(int index) {
+        set(index);
+    }
+    
     // Setters
     void set(int index) {
         init = true;
@@ -83,9 +419,9 @@ public:
         return _index;
     }
     
-    int* getIndices() {
+    array<int, 2> getIndices() {
         if (!init) cerr << "NOT INIT" << endl;
-        int* ret = new int[2];
+        array<int, 2> ret;
         ret[0] = _index/4;
         ret[1] = 2*(_index%4) + (ret[0])%2;
         
@@ -94,185 +430,179 @@ public:
     
     string toString() {
         if (!init) cerr << "NOT INIT" << endl;
-        int* indices = getIndices();
+        array<int, 2> indices = getIndices();
         string s = "";
         s += ('A' + indices[1]);
         s += to_string(indices[0] + 1);
         return s;
     }
-    
-    // Other
-    bool isNeighbor(Square s) {
-        if (!init) cerr << "NOT INIT" << endl;
-        int* a = getIndices();
-        int* b = s.getIndices();
-        return abs((a[0]-b[0])*(a[1]-b[1])) == 1;
-    }
-    
-    Square getMiddle(Square s) {
-        if (!init) cerr << "NOT INIT" << endl;
-        // We ASSUME they are neighbors
-        Square m;
-        int* i0 = getIndices();
-        int* i2 = s.getIndices();
-        m.setByIndices((i0[0]+i2[0])/2, (i0[1]+i2[1])/2);
-        return m;
-    }
-    
-    vector<Square> potentialNeighbors() {
-        if (!init) cerr << "NOT INIT" << endl;
-        int* indices = getIndices();
-        vector<Square> locations(4);
-        for (int i = 0; i < 2; ++i) {
-            for (int j = 0; j < 2; ++j) {
-                int I = indices[0] - 1 + 2*i, J = indices[1] - 1 + 2*j;
-                if (I < 8 && I > -1 && J < 8 && J > -1) {
-                    locations[2*i + j].setByIndices(I, J);
-                } else {
-                    locations[2*i + j].set(-1);
-                }
-            }
-        }
-        return locations;
-    }
-    
-    vector<vector<Square>> potentialJumps() {
-        if (!init) cerr << "NOT INIT" << endl;
-        
-        int* indices = getIndices();
-        vector<Square> end(4);
-        for (int i = 0; i < 2; ++i) {
-            for (int j = 0; j < 2; ++j) {
-                int I = indices[0] - 2 + 4*i, J = indices[1] - 2 + 4*j;
-                if (I < 8 && I > -1 && J < 8 && J > -1) {
-                    end[2*i + j].setByIndices(I, J);
-                } else {
-                    end[2*i + j].set(-1);
-                }
-            }
-        }
-
-        vector<Square> middle = potentialNeighbors();
-        
-        vector<vector<Square>> jumps(4);
-        for (int i = 0; i < 4; ++i) {
-            jumps[i] = {middle[i], end[i]};
-        }
-        
-        return jumps;
-    }
 };
 
 
 
 
 
-class Atom {
+// A move is packed in 64 bits : the start square on bits 0-4, the number of
+// steps on bits 5-8, then 5 bits for each landing square from bit 9.
+#define MAX_STEPS 11
+
+class Move {
 
 private:
     
-    Square _fr;
-    Square _mi;
-    Square _to;
-    bool _capture;
+    uint64_t _code;
+    
+    
+public:
 
+    Move() : _code(0) {}
 
-public:
-    
-    Atom(Square fr, Square to) : _fr(fr), _to(to), _capture(false) {
-#ifdef TESTING_BOARD
-        if(!_fr.isNeighbor(_to)) { 
-            cerr << "Not neighbors " << fr.toString() << " " << to.toString() << endl;
-            int* a = to.getIndices();
-            int* b = fr.getIndices();
-            cerr << (a[0]-b[0]) << " " << (a[1]-b[1]) << " " << ((a[0]-b[0])*(a[1]-b[1])) << " " << abs((a[0]-b[0])*(a[1]-b[1])) << " " << (abs((a[0]-b[0])*(a[1]-b[1])) == 1) << endl;
+    Move(int fr) : _code(fr) {}
+
+    Move(int fr, int to) : _code(fr) {
+        addStep(to);
+    }
+
+    Move(string moveString) : _code(0) {
+        Square s;
+        s.set(moveString.substr(0, 2));
+        _code = s.getIndex();
+        for (size_t done = 2; done + 1 < moveString.size(); done += 2) {
+            s.set(moveString.substr(done, 2));
+            addStep(s.getIndex());
         }
-#endif
     }
     
-    Atom(Square fr, Square mi, Square to) : _fr(fr), _mi(mi), _to(to), _capture(true) {
-#ifdef TESTING_BOARD
-        if(_fr.isNeighbor(_to)) { 
-            cerr << "Neighbors " << fr.toString() << " " << to.toString() << endl;
+    int getFr() {
+        return _code & 31;
+    }
+    
+    // Last landing square, or the start square of an empty chain
+    int getTo() {
+        int n = steps();
+        return n ? getStep(n - 1) : getFr();
+    }
+    
+    int steps() {
+        return (_code >> 5) & 15;
+    }
+    
+    int getStep(int k) {
+        return (_code >> (9 + 5*k)) & 31;
+    }
+    
+    bool isCapture() {
+        return abs(getStep(0) - getFr()) > 5;
+    }
+    
+    string toString() {
+        string s = Square(getFr()).toString();
+        for (int k = 0; k < steps(); ++k) {
+            s += Square(getStep(k)).toString();
         }
-#endif
+        return s;
     }
     
-    Atom(string s) {
-        _fr.set(s.substr(0, 2));
-        _to.set(s.substr(2, 2));
-        _capture = !_fr.isNeighbor(_to);
-        if (_capture) {
-            _mi = _fr.getMiddle(_to);
+    void addStep(int to) {
+        int n = steps();
+        if (n == MAX_STEPS) {
+            cerr << "Chain too long : " << toString() << endl;
+            return;
         }
+        _code += (uint64_t) 1 << 5;
+        _code |= (uint64_t) to << (9 + 5*n);
     }
     
-    Square getFr() {
-        return _fr;
+    void removeStep() {
+        int n = steps();
+        _code &= ~((uint64_t) 31 << (9 + 5*(n - 1)));
+        _code -= (uint64_t) 1 << 5;
     }
     
-    Square getMi() {
-        return _mi;
+    int chainSize() {
+        return steps();
     }
     
-    Square getTo() {
-        return _to;
+    uint64_t getCode() {
+        return _code;
     }
     
-    bool isCapture() {
-        return _capture;
+    // Squares jumped over by a capture
+    Bitboard captures() {
+        if (!isCapture()) return 0;
+        Bitboard captured = 0;
+        int square = getFr();
+        for (int k = 0; k < steps(); ++k) {
+            captured |= 1u << middle(square, getStep(k));
+            square = getStep(k);
+        }
+        return captured;
     }
     
+    bool operator==(const Move & other) const {
+        return _code == other._code;
+    }
 };
 
 
 
 
 
-class Move {
+// Fixed-capacity move list, lives on the stack of the search
+#define MAX_MOVES 128
+
+class MoveList {
 
 private:
     
-    vector<Atom> _atoms;
+    Move _moves[MAX_MOVES];
+    int _size;
     
     
 public:
-
-    Move(Atom atom) {
-        _atoms.push_back(atom);
-    }
-
-    Move(string moveString) {
-        int iterations = moveString.size()/2 - 1;
-        int done = 0;
-        while (done < iterations) {
-            _atoms.push_back(Atom(moveString.substr(done * 2, 4)));
-            ++done;
+    
+    MoveList() : _size(0) {}
+    
+    void push(Move move) {
+        if (_size == MAX_MOVES) {
+            cerr << "Move list full" << endl;
+            return;
         }
+        _moves[_size++] = move;
     }
     
-    vector<Atom> getAtoms() {
-        return _atoms;
+    void clear() {
+        _size = 0;
     }
     
-    string toString() {
-        string s = _atoms[0].getFr().toString();
-        for (auto && atom : _atoms) {
-            s += atom.getTo().toString();
-        }
-        return s;
+    int size() {
+        return _size;
     }
     
-    void addStart(Atom atom) {
-        _atoms.insert(_atoms.begin(), atom);
+    bool empty() {
+        return _size == 0;
     }
     
-    int chainSize() {
-        return _atoms.size();
+    Move & operator[](int i) {
+        return _moves[i];
+    }
+    
+    Move* begin() {
+        return _moves;
+    }
+    
+    Move* end() {
+        return _moves + _size;
     }
 };
 
 
+struct moveScoreType {
+    Move move;
+    int score;
+};
+
+
 
 
 
@@ -281,191 +611,332 @@ class Board {
 private:
 
     static const int tabSize = 4 * 8;
-    char _board[tabSize];
-    //int _evaluation;
+    
+    // One bit per playable square, bit i is _board[i] of the old array
+    Bitboard _red;
+    Bitboard _black;
+    Bitboard _kings;
     
     int _rMan;
     int _rKing;
     int _bMan;
     int _bKing;
+    // center distance of the red kings minus that of the black kings
+    int _kingsCenter;
+    
+    uint64_t _hash;
     
     
 public:
     
     Board() {
-        for (int i = 0; i < tabSize; ++i) {
-            _board[i] = '.';
-        }
-        //_evaluation = 0;
+        _red = 0; _black = 0; _kings = 0;
         _rMan = 0; _bMan = 0; _rKing = 0; _bKing = 0;
-    }
-    
-    Board(Board& b) {
-        for (int i = 0; i < tabSize; ++i) {
-            _board[i] = b._board[i];
-        }
-        //_evaluation = b._evaluation;
-        _rMan = b._rMan; _rKing = b._rKing; _bMan = b._bMan; _bKing = b._bKing;
+        _kingsCenter = 0;
+        _hash = 0;
     }
     
     char get(int i, int j) {
         if (i < 0 || j < 0 || i > 9 || j > 7) {
             return '#';
         }
-        return _board[4*i + j/2];
+        return get(4*i + j/2);
     }
     
     char get(int index) {
         if (index < 0 || index >= tabSize) {
             return '#';
         }
-        return _board[index];
+        Bitboard bit = 1u << index;
+        if (_red & bit) return (_kings & bit) ? 'R' : 'r';
+        if (_black & bit) return (_kings & bit) ? 'B' : 'b';
+        return '.';
     }
     
     char get(Square s) {
         return get(s.getIndex());
     }
     
+    Bitboard pieces(char color) {
+        return (color == 'r') ? _red : _black;
+    }
+    
+    Bitboard kings() {
+        return _kings;
+    }
+    
+    Bitboard empty() {
+        return ~(_red | _black);
+    }
+    
+    uint64_t hash() {
+        return _hash;
+    }
+    
+    // Zobrist key of the piece standing on a square, 0 if it is empty
+    uint64_t key(int index) {
+        Bitboard bit = 1u << index;
+        if (!((_red | _black) & bit)) return 0;
+        return ZOBRIST.pieces[pieceIndex(_red & bit, _kings & bit)][index];
+    }
+    
     void set(int i, int j, char value) {
 #ifdef TESTING_BOARD
         if ((i+j) % 2 != 0 || i < 0 || j < 0 || i > 9 || j > 7) {
             cerr << "mistake on the indexes : " << i << " " << j << endl;
         }
 #endif
-        _board[4*i + j/2] = value;
+        int index = 4*i + j/2;
+        Bitboard bit = 1u << index;
+        _hash ^= key(index);
+        _red &= ~bit; _black &= ~bit; _kings &= ~bit;
+        
+        switch (value) {
+            case '.':
+            break;
+            
+            case 'r':
+            _red |= bit;
+            break;
+            
+            case 'b':
+            _black |= bit;
+            break;
+            
+            case 'R':
+            _red |= bit; _kings |= bit;
+            break;
+            
+            case 'B':
+            _black |= bit; _kings |= bit;
+            break;
+            
+            default:
+            cerr << "Piece not recognized : " << value << endl;
+        }
+        _hash ^= key(index);
     }
     
-    void play(Move move) {
-        for (auto && atom : move.getAtoms()) {
-            play(atom);
+    // Reads the 8 lines of the referee, top row first
+    void read(istream & input) {
+        for (int i = 7; i > -1; --i) {
+            string inputLine; // board line
+            getline(input, inputLine);
+            for (int j = 0; j < 8; ++j) {
+                if ((i+j)%2 == 0) {
+                    set(i, j, inputLine[j]);
+                }
+            }
+        }
+        setEvaluation();
+    }
+    
+    // The 8 lines read by read
+    void write(ostream & output) {
+        for (int i = 7; i > -1; --i) {
+            for (int j = 0; j < 8; ++j) {
+                output << (((i+j)%2 == 0) ? get(i, j) : '.');
+            }
+            output << '\n';
+        }
+    }
+    
+    // One character per square, in index order
+    void setSquares(const string & squares) {
+        for (int index = 0; index < tabSize; ++index) {
+            array<int, 2> indices = Square(index).getIndices();
+            set(indices[0], indices[1], squares[index]);
         }
+        setEvaluation();
+    }
+    
+    // Black on the first three rows, red on the last three
+    void setStart() {
+        for (int index = 0; index < tabSize; ++index) {
+            array<int, 2> indices = Square(index).getIndices();
+            set(indices[0], indices[1], index < 12 ? 'b' : index >= 20 ? 'r' : '.');
+        }
+        setEvaluation();
+    }
+    
+    // Any set of pieces, kings being a subset of red | black
+    void setPieces(Bitboard red, Bitboard black, Bitboard kings) {
+        _red = red; _black = black; _kings = kings;
+        _hash = 0;
+        Bitboard all = red | black;
+        while (all) {
+            _hash ^= key(popLsb(all));
+        }
+        setEvaluation();
+    }
+    
+    void play(Move move) {
+        undoType undo;
+        play(move, undo);
     }
     
-    void play(Atom atom) {
+    // Plays a whole move at once, undo gets what undo(move, undo) needs
+    void play(Move move, undoType & undo) {
         
-        char piece = get(atom.getFr());
+        Bitboard frBit = 1u << move.getFr();
+        Bitboard toBit = 1u << move.getTo();
+        bool red = _red & frBit;
+        bool king = _kings & frBit;
+        Bitboard & own = red ? _red : _black;
+        Bitboard & other = red ? _black : _red;
         
-        // detect crowning
-        int* toIndices = atom.getTo().getIndices();
-        if (piece == 'r' && toIndices[0] == 0) {
-            piece = 'R';
-            //_evaluation += KING_VALUE - 1;
-            _rMan--; _rKing++;
+        Bitboard captured = 0;
+        Bitboard landings = toBit;
+        if (move.isCapture()) {
+            int square = move.getFr();
+            for (int k = 0; k < move.steps(); ++k) {
+                int next = move.getStep(k);
+                captured |= 1u << middle(square, next);
+                landings |= 1u << next;
+                square = next;
+            }
         }
         
-        else if (piece == 'b' && toIndices[0] == 7) {
-            piece = 'B';
-            //_evaluation -= KING_VALUE - 1;
-            _bMan--; _bKing++;
+        undo.captured = captured;
+        undo.capturedKings = captured & _kings;
+        undo.crowned = !king && (landings & (red ? ROW_0 : ROW_7));
+        
+        undo.hash = _hash;
+        undo.kingsCenter = _kingsCenter;
+        _hash ^= ZOBRIST.pieces[pieceIndex(red, king)][move.getFr()];
+        _hash ^= ZOBRIST.pieces[pieceIndex(red, king || undo.crowned)][move.getTo()];
+        Bitboard taken = captured;
+        while (taken) {
+            int index = popLsb(taken);
+            _hash ^= ZOBRIST.pieces[pieceIndex(!red, (undo.capturedKings >> index) & 1)][index];
         }
         
+        int kingsTaken = popCount(undo.capturedKings);
+        int menTaken = popCount(captured) - kingsTaken;
+        int center = (king ? -CENTER_DISTANCE[move.getFr()] : 0) + ((king || undo.crowned) ? CENTER_DISTANCE[move.getTo()] : 0);
+        center += centerDistance(undo.capturedKings);
+        _kingsCenter += red ? center : -center;
+        if (red) {
+            _bMan -= menTaken; _bKing -= kingsTaken;
+            if (undo.crowned) { _rMan--; _rKing++; }
+        } else {
+            _rMan -= menTaken; _rKing -= kingsTaken;
+            if (undo.crowned) { _bMan--; _bKing++; }
+        }
         
-        _board[atom.getFr().getIndex()] = '.';
-        _board[atom.getTo().getIndex()] = piece;
+        // the start square may also be the last landing of a king loop
+        own = (own & ~frBit) | toBit;
+        other &= ~captured;
+        _kings &= ~(captured | frBit);
+        if (king || undo.crowned) _kings |= toBit;
+    }
+    
+    void undo(Move move, undoType & undo) {
         
+        Bitboard frBit = 1u << move.getFr();
+        Bitboard toBit = 1u << move.getTo();
+        bool red = _red & toBit;
+        bool king = (_kings & toBit) && !undo.crowned;
+        Bitboard & own = red ? _red : _black;
+        Bitboard & other = red ? _black : _red;
         
-        // detect capture
-        if (atom.isCapture()) {
-            switch (get(atom.getMi())) {
-                case 'r': 
-                //--_evaluation;
-                _rMan--;
-                break;
-                
-                case 'b':
-                //++_evaluation;
-                _bMan--;
-                break;
-                
-                case 'R':
-                //_evaluation -= KING_VALUE;
-                _rKing--;
-                break;
-                
-                case 'B':
-                //_evaluation += KING_VALUE;
-                _bKing--;
-                break;
-                
-                default:
-                cerr << "No piece found : " << get(atom.getMi()) << " " << atom.getFr().toString() << atom.getMi().toString() << atom.getTo().toString() << endl;
-            }
-            
-            _board[atom.getMi().getIndex()] = '.';
+        own = (own & ~toBit) | frBit;
+        _kings &= ~toBit;
+        if (king) _kings |= frBit;
+        other |= undo.captured;
+        _kings |= undo.capturedKings;
+        _hash = undo.hash;
+        _kingsCenter = undo.kingsCenter;
+        
+        int kingsTaken = popCount(undo.capturedKings);
+        int menTaken = popCount(undo.captured) - kingsTaken;
+        if (red) {
+            _bMan += menTaken; _bKing += kingsTaken;
+            if (undo.crowned) { _rMan++; _rKing--; }
+        } else {
+            _rMan += menTaken; _rKing += kingsTaken;
+            if (undo.crowned) { _bMan++; _bKing--; }
         }
     }
     
+    // Every term is kept up to date by play and undo
     int redEvaluation() {
-        
-        int materialLeft = _rMan+_bMan+_rKing+_bKing;
-        float value = MAN_VALUE*(_rMan-_bMan) + KING_VALUE*(_rKing - _bKing);
-        
-        if (materialLeft < 15) {
-            vector<Square> rKings = selectPieces('R');
-            for (auto && king : rKings) {
-                int* indices = king.getIndices();
-                value -= max(abs(2*indices[0]-7), abs(2*indices[1]-7));
-            }
-            vector<Square> bKings = selectPieces('B');
-            for (auto && king : bKings) {
-                int* indices = king.getIndices();
-                value += max(abs(2*indices[0]-7), abs(2*indices[1]-7));
-            }
-            
-        }
-        
-        value /= materialLeft;
-        return (int) value ;
-        
+        return evaluation(WEIGHTS, _rMan - _bMan, _rKing - _bKing, -_kingsCenter, _rMan + _bMan + _rKing + _bKing);
+    }
+    
+    // Terms of redEvaluation : men, kings, center, material
+    array<int, 4> features() {
+        return {_rMan - _bMan, _rKing - _bKing, -_kingsCenter, _rMan + _bMan + _rKing + _bKing};
+    }
+    
+    // Hundredths of a man in evaluation units, the evaluation being divided
+    // by the material
+    int menValue(int hundredths) {
+        return hundredths * WEIGHTS.man / (100 * max(_rMan + _bMan + _rKing + _bKing, 1));
     }
     
     void setEvaluation() {
-        //_evaluation = 0;
-        _rMan = 0; _bMan = 0; _rKing = 0; _bKing = 0;
-        for (int i = 0; i < tabSize; ++i) {
-            switch (_board[i]) {
-                case '.':
-                break;
-                
-                case 'r': 
-                _rMan++;
-                //++_evaluation;
-                break;
-                
-                case 'b':
-                _bMan++;
-                //--_evaluation;
-                break;
-                
-                case 'R':
-                _rKing++;
-                //_evaluation += KING_VALUE;
-                break;
-                
-                case 'B':
-                _bKing++;
-                //_evaluation -= KING_VALUE;
-                break;
-                
-                default:
-                cerr << "Piece not recognized : " << _board[i] << endl;
-            }
-        }
+        _rMan = popCount(_red & ~_kings);
+        _rKing = popCount(_red & _kings);
+        _bMan = popCount(_black & ~_kings);
+        _bKing = popCount(_black & _kings);
+        _kingsCenter = centerDistance(_red & _kings) - centerDistance(_black & _kings);
     }
+};
+
+
+
+
+// Positions packed one term per array, to be evaluated in a batch
+struct evalBatchType {
+    vector<int32_t> men;
+    vector<int32_t> kings;
+    vector<int32_t> center;
+    vector<int32_t> material;
     
-    vector<Square> selectPieces(char color) {
-        vector<Square> pieceLocations;
-        for (int i = 0; i < tabSize; ++i) {
-            if (tolower(_board[i]) == color) {
-                Square s;
-                s.set(i);
-                pieceLocations.push_back(s);
-            }
-        }
-        return pieceLocations;
+    void push(Board & board) {
+        array<int, 4> f = board.features();
+        men.push_back(f[0]);
+        kings.push_back(f[1]);
+        center.push_back(f[2]);
+        material.push_back(f[3]);
+    }
+    
+    size_t size() const {
+        return men.size();
     }
 };
 
+// redEvaluation of every position of the batch, 8 at a time with AVX2. The
+// division goes through floats, exact for these values, and truncates
+// toward zero like the integer one.
+void evaluateBatch(const weightsType & w, const evalBatchType & batch, int32_t * out) {
+    
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256i man = _mm256_set1_epi32(w.man);
+    __m256i king = _mm256_set1_epi32(w.king);
+    __m256i center = _mm256_set1_epi32(w.center);
+    __m256i endgame = _mm256_set1_epi32(ENDGAME_PIECES);
+    for (; i + 8 <= batch.size(); i += 8) {
+        __m256i men = _mm256_loadu_si256((const __m256i *) &batch.men[i]);
+        __m256i kings = _mm256_loadu_si256((const __m256i *) &batch.kings[i]);
+        __m256i centers = _mm256_loadu_si256((const __m256i *) &batch.center[i]);
+        __m256i material = _mm256_loadu_si256((const __m256i *) &batch.material[i]);
+        
+        __m256i value = _mm256_add_epi32(_mm256_mullo_epi32(man, men), _mm256_mullo_epi32(king, kings));
+        __m256i centered = _mm256_and_si256(_mm256_cmpgt_epi32(endgame, material), _mm256_mullo_epi32(center, centers));
+        value = _mm256_add_epi32(value, centered);
+        
+        __m256 quotient = _mm256_div_ps(_mm256_cvtepi32_ps(value), _mm256_cvtepi32_ps(material));
+        _mm256_storeu_si256((__m256i *) &out[i], _mm256_cvttps_epi32(quotient));
+    }
+#endif
+    for (; i < batch.size(); ++i) {
+        out[i] = evaluation(w, batch.men[i], batch.kings[i], batch.center[i], batch.material[i]);
+    }
+}
+
 
 
 
@@ -486,8 +957,18 @@ public:
         _turn = oppositeColor(_turn);
     }
 
-    void play(Atom atom) {
-        _board.play(atom);
+    void play(Move move, undoType & undo) {
+        _board.play(move, undo);
+        _turn = oppositeColor(_turn);
+    }
+
+    void undo(Move move, undoType & undo) {
+        _board.undo(move, undo);
+        _turn = oppositeColor(_turn);
+    }
+
+    uint64_t hash() {
+        return _board.hash() ^ (_turn == 'b' ? ZOBRIST.blackToMove : 0);
     }
     
     int evaluate() {
@@ -498,86 +979,776 @@ public:
         return score;
     }
     
-    vector<Move> generateMoves() {
+    // All the legal moves, or with unique one move per resulting position
+    void generateMoves(MoveList & moves, bool unique = false) {
         
-        vector<Move> moves;
-        bool canCapture = false;
-        vector<Square> myPieces = _board.selectPieces(_turn);
+        moves.clear();
+        Bitboard mine = _board.pieces(_turn);
+        Bitboard kings = mine & _board.kings();
+        Bitboard ennemies = _board.pieces(oppositeColor(_turn));
+        Bitboard empty = _board.empty();
+        int forward = (_turn == 'r') ? DIR_DOWN : DIR_UP;
         
-        for (auto && piece : myPieces) {
-            
-            bool mem = canCapture;
-            
-            vector<Move> pieceMoves = squareMoves(piece, canCapture);
-            
-            if (canCapture ^ mem) {
-                // First time we find captures. Previous moves are not valid
-                moves = pieceMoves;
-            } else {
-                moves.insert(moves.end(), pieceMoves.begin(), pieceMoves.end());
+        // Pieces with at least one capture, all directions at once
+        Bitboard jumpers = 0;
+        for (int dir = 0; dir < 4; ++dir) {
+            Bitboard movers = (dir / 2 == forward) ? mine : kings;
+            Bitboard landings = neighbors(neighbors(movers, dir) & ennemies, dir) & empty;
+            jumpers |= neighbors(neighbors(landings, 3 - dir), 3 - dir);
+        }
+        
+        if (jumpers) {
+            while (jumpers) {
+                int square = popLsb(jumpers);
+                Move path(square);
+                captureChains(path, (kings >> square) & 1, ennemies, empty | (1u << square), moves, unique ? moves.size() : -1);
             }
+            return;
         }
         
-        return moves;
+        for (int dir = 0; dir < 4; ++dir) {
+            Bitboard movers = (dir / 2 == forward) ? mine : kings;
+            Bitboard targets = neighbors(movers, dir) & empty;
+            while (targets) {
+                int to = popLsb(targets);
+                moves.push(Move(lsb(neighbors(1u << to, 3 - dir)), to));
+            }
+        }
     }
     
     
     
-    vector<Move> squareMoves(Square square, bool & mustCapture) {
+    // Capture chains extending path, walked depth first without touching the
+    // board : the jumping piece has left its start square, and the pieces
+    // taken so far are out of ennemies and back in empty. path is the one
+    // buffer of the walk, a step is added before going down and removed on
+    // the way back. Chains pushed from index first on are compared to drop
+    // those taking the same pieces to the same square, unless first < 0.
+    void captureChains(Move & path, bool king, Bitboard ennemies, Bitboard empty, MoveList & moves, int first) {
         
-        vector<Move> moves;
-        vector<Atom> captures = findCaptures(square);
+        int square = path.getTo();
+        Bitboard landings = findCaptures(square, king, ennemies, empty);
         
-        if (captures.size() != 0) {
-            mustCapture = true;
-            for (auto && capture : captures) {
-                Position p(*this);
-                p.play(capture);
-                vector<Move> chainMoves = p.squareMoves(capture.getTo(), mustCapture);
-                if (chainMoves.size() == 0) {
-                    moves.push_back(Move(capture));
-                } else {
-                    for (auto && chain : chainMoves) {
-                        chain.addStart(capture);
-                        moves.push_back(chain);
-                    }
+        if (!landings) {
+            if (path.steps() == 0) return;
+            if (first >= 0) {
+                Bitboard captured = path.captures();
+                for (int i = first; i < moves.size(); ++i) {
+                    if (moves[i].getTo() == square && moves[i].captures() == captured) return;
                 }
             }
+            moves.push(path);
+            return;
+        }
+        
+        while (landings) {
+            int to = popLsb(landings);
+            Bitboard taken = 1u << middle(square, to);
+            bool crowned = !king && ((1u << to) & (_turn == 'r' ? ROW_0 : ROW_7));
+            path.addStep(to);
+            captureChains(path, king || crowned, ennemies & ~taken, (empty | taken) & ~(1u << to), moves, first);
+            path.removeStep();
+        }
+    }
+    
+    // Landing squares of the captures available from a square, for a piece
+    // among ennemies and empty squares that may differ from the board's
+    Bitboard findCaptures(int square, bool king, Bitboard ennemies, Bitboard empty) {
+        
+        int directions = king ? KING_DIRECTIONS : (_turn == 'r') ? RED_MAN_DIRECTIONS : BLACK_MAN_DIRECTIONS;
+        
+        Bitboard landings = 0;
+        for (int dir = 0; dir < 4; ++dir) {
+            if ((directions >> dir & 1) && (SQUARE_TABLES.neighbor[square][dir] & ennemies)) {
+                landings |= SQUARE_TABLES.landing[square][dir] & empty;
+            }
+        }
+        return landings;
+    }
+};
+
+
+
+
+
+// Transposition table : one entry per slot, indexed by the low bits of the
+// position hash. Moves are kept as the low 32 bits of their code, which is
+// enough to find them back in the generated list.
+//
+// The table is shared by the search threads without locks. A slot holds the
+// entry packed in one 64-bit word and the key xored with that word, so an
+// entry half written by another thread fails the key check.
+//
+// The table lives from one move to the next. Each search starts a new
+// generation, and the entries of older ones give way to the results of
+// other positions.
+#define TT_EXACT 0
+#define TT_LOWER 1
+#define TT_UPPER 2
+
+struct ttEntryType {
+    uint64_t key;
+    uint32_t move;
+    int score;
+    int8_t depth;
+    uint8_t bound;
+};
+
+struct ttSlotType {
+    atomic<uint64_t> check;
+    atomic<uint64_t> data;
+};
+
+class TranspositionTable {
+
+private:
+    
+    unique_ptr<ttSlotType[]> _slots;
+    uint64_t _mask;
+    atomic<uint64_t> _generation;
+    
+    // move on bits 0-31, score + 2^19 on bits 32-51, depth on 52-59, bound on
+    // 60-61, generation modulo 4 on 62-63
+    static uint64_t pack(uint32_t move, int score, int depth, int bound, uint64_t generation) {
+        return move | (uint64_t) (score + (1 << 19)) << 32 | (uint64_t) depth << 52 | (uint64_t) bound << 60 | generation << 62;
+    }
+    
+    
+public:
+    
+    TranspositionTable(int megabytes) : _generation(0) {
+        resize(megabytes);
+    }
+    
+    void resize(int megabytes) {
+        size_t size = 1;
+        while (2 * size * sizeof(ttSlotType) <= ((size_t) megabytes << 20)) {
+            size *= 2;
+        }
+        _slots.reset(new ttSlotType[size]);
+        _mask = size - 1;
+        clear();
+    }
+    
+    void clear() {
+        for (uint64_t i = 0; i <= _mask; ++i) {
+            _slots[i].check.store(0, memory_order_relaxed);
+            _slots[i].data.store(0, memory_order_relaxed);
         }
+    }
+    
+    bool probe(uint64_t key, ttEntryType & entry) {
+        ttSlotType & slot = _slots[key & _mask];
+        uint64_t data = slot.data.load(memory_order_relaxed);
+        if ((slot.check.load(memory_order_relaxed) ^ data) != key) return false;
         
-        if (moves.empty() && !mustCapture) {
-            char value = _board.get(square);
-            vector<Square> potential = square.potentialNeighbors();
-            for (auto && location : potential) {
-                if (value == 'r' && location.getIndex() > square.getIndex()) continue;
-                if (value == 'b' && location.getIndex() < square.getIndex()) continue;
-                if (_board.get(location) != '.') continue;
-                moves.push_back(Move(Atom(square, location)));
+        entry.key = key;
+        entry.move = (uint32_t) data;
+        entry.score = (int) ((data >> 32) & 0xFFFFF) - (1 << 19);
+        entry.depth = (data >> 52) & 0xFF;
+        entry.bound = (data >> 60) & 3;
+        return true;
+    }
+    
+    // Game over scores grow with the depth left when they are found, they
+    // are kept relative to the depth of the node storing them so that any
+    // transposition reads back the score of its own depth
+    static int toTable(int score, int depth) {
+        return (score > TB_WIN) ? score - depth : (score < -TB_WIN) ? score + depth : score;
+    }
+    
+    static int fromTable(int score, int depth) {
+        return (score > TB_WIN) ? score + depth : (score < -TB_WIN) ? score - depth : score;
+    }
+    
+    void newSearch() {
+        _generation.store((_generation.load(memory_order_relaxed) + 1) & 3, memory_order_relaxed);
+    }
+    
+    void store(uint64_t key, int depth, int bound, int score, Move move) {
+        ttSlotType & slot = _slots[key & _mask];
+        uint64_t old = slot.data.load(memory_order_relaxed);
+        uint64_t generation = _generation.load(memory_order_relaxed);
+        // keep a deeper result for the same position, or for another one
+        // when it comes from this search
+        bool same = (slot.check.load(memory_order_relaxed) ^ old) == key;
+        int oldDepth = (old >> 52) & 0xFF;
+        if (oldDepth > depth && (same || (old >> 62) == generation)) return;
+        
+        uint64_t data = pack((uint32_t) move.getCode(), score, depth, bound, generation);
+        slot.check.store(key ^ data, memory_order_relaxed);
+        slot.data.store(data, memory_order_relaxed);
+    }
+};
+
+TranspositionTable tt(TT_MEGABYTES);
+
+
+
+// Endgame tables, built backwards from the positions without moves. There
+// is one table per material (red men, red kings, black men, black kings)
+// with red to move, a position with black to move is looked up turned
+// around with the colors swapped. Each group of pieces is ranked among the
+// 32 squares, so that an index is the ranks of the four groups, and gets
+// one byte : 0 for a draw, otherwise 1 + the number of plies until the
+// side to move has no move left, even for a win and odd for a loss.
+class Tablebase {
+
+private:
+    
+    int _pieces;
+    const uint8_t * _data;
+    size_t _mapped;
+    uint64_t _binomial[33][8];
+    vector<array<int, 4>> _materials;
+    vector<uint64_t> _offsets;
+    uint64_t _total;
+    
+    static int code(int rm, int rk, int bm, int bk) {
+        return rm | rk << 3 | bm << 6 | bk << 9;
+    }
+    
+    // Square i to square 31 - i, the board seen by the other side
+    static Bitboard mirror(Bitboard b) {
+        b = (b >> 1 & 0x55555555u) | (b & 0x55555555u) << 1;
+        b = (b >> 2 & 0x33333333u) | (b & 0x33333333u) << 2;
+        b = (b >> 4 & 0x0F0F0F0Fu) | (b & 0x0F0F0F0Fu) << 4;
+        b = (b >> 8 & 0x00FF00FFu) | (b & 0x00FF00FFu) << 8;
+        return b >> 16 | b << 16;
+    }
+    
+    uint64_t rank(Bitboard b) {
+        uint64_t r = 0;
+        for (int k = 1; b; ++k) {
+            r += _binomial[popLsb(b)][k];
+        }
+        return r;
+    }
+    
+    Bitboard unrank(uint64_t r, int k) {
+        Bitboard b = 0;
+        for (int s = 31; k > 0; --s) {
+            if (_binomial[s][k] <= r) {
+                r -= _binomial[s][k];
+                b |= 1u << s;
+                --k;
+            }
+        }
+        return b;
+    }
+    
+    // Position i of the table of material m, false if it cannot be reached
+    bool position(const array<int, 4> & m, uint64_t i, Board & board) {
+        Bitboard bk = unrank(i % _binomial[32][m[3]], m[3]); i /= _binomial[32][m[3]];
+        Bitboard bm = unrank(i % _binomial[32][m[2]], m[2]); i /= _binomial[32][m[2]];
+        Bitboard rk = unrank(i % _binomial[32][m[1]], m[1]); i /= _binomial[32][m[1]];
+        Bitboard rm = unrank(i, m[0]);
+        // pieces on the same square, a red man on row 0 or a black one on row 7
+        if (popCount(rm | rk | bm | bk) != m[0] + m[1] + m[2] + m[3] || (rm & ROW_0) || (bm & ROW_7)) return false;
+        board.setPieces(rm | rk, bm | bk, rk | bk);
+        return true;
+    }
+    
+    uint64_t size(const array<int, 4> & m) {
+        return _binomial[32][m[0]] * _binomial[32][m[1]] * _binomial[32][m[2]] * _binomial[32][m[3]];
+    }
+    
+    // Tables ordered by pieces, then by men : a capture leads to fewer
+    // pieces and a crowning to fewer men, so only the quiet moves stay in
+    // the group being built
+    void layout(int pieces) {
+        _pieces = pieces;
+        _materials.clear();
+        _offsets.assign(1 << 12, 0);
+        _total = 0;
+        for (int total = 2; total <= pieces; ++total) {
+            for (int men = 0; men <= total; ++men) {
+                for (int rm = 0; rm <= men; ++rm) {
+                    int bm = men - rm;
+                    for (int rk = 0; rk <= total - men; ++rk) {
+                        int bk = total - men - rk;
+                        if (rm + rk == 0 || bm + bk == 0) continue;
+                        _materials.push_back({rm, rk, bm, bk});
+                        _offsets[code(rm, rk, bm, bk)] = _total;
+                        _total += size(_materials.back());
+                    }
+                }
+            }
+        }
+    }
+    
+    // Where the position with red to move is stored, red and black given
+    // from the side to move
+    uint64_t index(Bitboard red, Bitboard black, Bitboard kings) {
+        int rm = popCount(red & ~kings), rk = popCount(red & kings);
+        int bm = popCount(black & ~kings), bk = popCount(black & kings);
+        uint64_t i = rank(red & ~kings);
+        i = i * _binomial[32][rk] + rank(red & kings);
+        i = i * _binomial[32][bm] + rank(black & ~kings);
+        i = i * _binomial[32][bk] + rank(black & kings);
+        return _offsets[code(rm, rk, bm, bk)] + i;
+    }
+    
+    uint64_t index(Position & pos) {
+        Bitboard red = pos._board.pieces('r');
+        Bitboard black = pos._board.pieces('b');
+        Bitboard kings = pos._board.kings();
+        if (pos._turn == 'r') {
+            return index(red, black, kings);
+        }
+        return index(mirror(black), mirror(red), mirror(kings));
+    }
+    
+    
+public:
+    
+    Tablebase() : _pieces(0), _data(nullptr), _mapped(0), _total(0) {
+        for (int n = 0; n <= 32; ++n) {
+            for (int k = 0; k < 8; ++k) {
+                _binomial[n][k] = (k == 0) ? 1 : (n == 0) ? 0 : _binomial[n-1][k-1] + _binomial[n-1][k];
             }
         }
+    }
+    
+    ~Tablebase() {
+        if (_mapped) munmap((void *) _data, _mapped);
+    }
+    
+    int pieces() {
+        return _pieces;
+    }
+    
+    // Maps the file built by generate, the pages are read on demand
+    bool load(const string & file) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < 8) {
+            close(fd);
+            return false;
+        }
+        void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        
+        // the piece count sizes the layout, so it is checked before use
+        const uint8_t * data = (const uint8_t *) map;
+        bool valid = string((const char *) data, 4) == "CKTB" && data[4] >= 2 && data[4] <= 7;
+        if (valid) layout(data[4]);
+        if (!valid || (uint64_t) st.st_size != 8 + _total) {
+            cerr << "Bad tablebase file " << file << endl;
+            munmap(map, st.st_size);
+            _pieces = 0;
+            return false;
+        }
+        _data = data + 8;
+        _mapped = st.st_size;
+        return true;
+    }
+    
+    // Score of a position with few enough pieces, from the side to move
+    bool probe(Position & pos, int & score) {
+        Bitboard red = pos._board.pieces('r');
+        Bitboard black = pos._board.pieces('b');
+        if (popCount(red | black) > _pieces || !red || !black) return false;
         
-        return moves;
+        int value = _data[index(pos)];
+        score = (value == 0) ? 0 : (value % 2) ? -(TB_WIN - value + 1) : TB_WIN - value + 1;
+        return true;
     }
     
-    vector<Atom> findCaptures(Square s) {
-        vector<Atom> captures;
-        vector<vector<Square>> jumps = s.potentialJumps();
+    // Retrograde analysis. Every position of a group is visited again and
+    // again : it is lost when it has no move or all its moves lead to a
+    // won position, won when one of them leads to a lost one. What is left
+    // once the passes give nothing more is a draw.
+    void generate(int pieces, const string & file) {
+        
+        layout(pieces);
+        vector<uint8_t> table(_total, 0);
+        auto start = chrono::steady_clock::now();
         
-        char ennemy = oppositeColor(_turn);
-        char value = _board.get(s);
+        // value of the position reached, 1 when the side to move has nothing left
+        auto lookup = [&](Position & pos) {
+            Bitboard own = pos._board.pieces(pos._turn);
+            return own ? table[index(pos)] : 1;
+        };
         
-        for (auto && jump : jumps) {
+        size_t first = 0;
+        while (first < _materials.size()) {
             
-            char v1 = _board.get(jump[0]), v2 = _board.get(jump[1]);
-            if (v2 != '.' || tolower(v1) != ennemy) continue;
+            size_t last = first;
+            auto men = [&](size_t i) { return _materials[i][0] + _materials[i][2]; };
+            auto total = [&](size_t i) { return _materials[i][0] + _materials[i][1] + _materials[i][2] + _materials[i][3]; };
+            while (last < _materials.size() && total(last) == total(first) && men(last) == men(first)) {
+                ++last;
+            }
             
-            if (value == 'r' && jump[1].getIndex() > s.getIndex()) continue;
-            if (value == 'b' && jump[1].getIndex() < s.getIndex()) continue;
+            // positions still open, as their material and index
+            vector<pair<uint32_t, uint64_t>> open;
+            for (size_t m = first; m < last; ++m) {
+                Board board;
+                for (uint64_t i = 0; i < size(_materials[m]); ++i) {
+                    if (position(_materials[m], i, board)) open.push_back({m, i});
+                }
+            }
             
-            captures.push_back(Atom(s, jump[0], jump[1]));
+            // values are given in increasing order, one per pass : a position
+            // takes the value of its fastest win once every shorter one is
+            // known, and of its slowest loss once all its replies are known.
+            // Past the longest value reached outside the group, at least the
+            // 1 of a side left with nothing, a pass giving nothing means no
+            // later one will.
+            size_t positions = open.size();
+            int longest = max<int>(1, *max_element(table.begin(), table.end()));
+            int passes = 0;
+            for (int value = 1; value < 255 && !open.empty(); ++value) {
+                bool changed = false;
+                ++passes;
+                size_t kept = 0;
+                for (auto && entry : open) {
+                    
+                    array<int, 4> & m = _materials[entry.first];
+                    Board board;
+                    position(m, entry.second, board);
+                    Position pos(board, 'r');
+                    MoveList moves;
+                    pos.generateMoves(moves);
+                    
+                    // values of the fastest loss and the slowest win reached
+                    int lost = 255, won = 0;
+                    bool allWon = true;
+                    for (auto && move : moves) {
+                        undoType undo;
+                        pos.play(move, undo);
+                        int reached = lookup(pos);
+                        pos.undo(move, undo);
+                        if (reached == 0) {
+                            allWon = false;
+                        } else if (reached % 2) {
+                            lost = min(lost, reached);
+                        } else {
+                            won = max(won, reached);
+                        }
+                    }
+                    
+                    bool done = moves.empty() ? value == 1 : (value % 2 == 0) ? lost == value - 1 : lost == 255 && allWon && won == value - 1;
+                    if (done) {
+                        table[_offsets[code(m[0], m[1], m[2], m[3])] + entry.second] = value;
+                        changed = true;
+                    } else {
+                        open[kept++] = entry;
+                    }
+                }
+                open.resize(kept);
+                if (!changed && value > longest) break;
+            }
             
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            cerr << total(first) << " pieces, " << men(first) << " men : " << positions << " positions, "
+                 << open.size() << " draws, " << passes << " passes, " << (int) seconds << " s" << endl;
+            first = last;
+        }
+        
+        ofstream out(file, ios::binary);
+        out.write("CKTB", 4);
+        char header[4] = {(char) pieces, 0, 0, 0};
+        out.write(header, 4);
+        out.write((const char *) table.data(), table.size());
+        cerr << "Wrote " << _total << " entries to " << file << endl;
+        _pieces = 0;
+    }
+};
+
+Tablebase tablebase;
+
+
+
+// Opening book : the moves played from a position, keyed by its hash and
+// weighted by how often they were played. The file is the entries sorted
+// by key, heaviest move first.
+struct bookEntryType {
+    uint64_t key;
+    uint64_t move;
+    uint64_t weight;
+};
+
+class OpeningBook {
+
+private:
+    
+    const bookEntryType * _entries;
+    size_t _size;
+    size_t _mapped;
+    
+    
+public:
+    
+    OpeningBook() : _entries(nullptr), _size(0), _mapped(0) {}
+    
+    ~OpeningBook() {
+        if (_mapped) munmap((void *) (_entries - 1), _mapped);
+    }
+    
+    size_t size() {
+        return _size;
+    }
+    
+    bool load(const string & file) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(bookEntryType) || st.st_size % sizeof(bookEntryType)) {
+            close(fd);
+            return false;
+        }
+        void * map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) return false;
+        
+        // the first entry is the header
+        const bookEntryType * entries = (const bookEntryType *) map;
+        if (string((const char *) map, 4) != "CKBK") {
+            cerr << "Bad book file " << file << endl;
+            munmap(map, st.st_size);
+            return false;
+        }
+        _entries = entries + 1;
+        _size = st.st_size / sizeof(bookEntryType) - 1;
+        _mapped = st.st_size;
+        return true;
+    }
+    
+    // Entries of the position, a binary search over the mapped file
+    pair<const bookEntryType *, const bookEntryType *> probe(uint64_t key) {
+        return equal_range(_entries, _entries + _size, bookEntryType{key, 0, 0},
+            [](const bookEntryType & a, const bookEntryType & b) { return a.key < b.key; });
+    }
+    
+    // Games are read one per line, as the moves played from the start
+    // position with red to move. The first plies of each game are counted.
+    static void build(istream & games, int plies, const string & file) {
+        
+        map<pair<uint64_t, uint64_t>, uint64_t> counts;
+        string line;
+        int read = 0;
+        while (getline(games, line)) {
+            Board board;
+            board.setStart();
+            Position pos(board, 'r');
+            istringstream moves(line);
+            string moveString;
+            for (int ply = 0; ply < plies && moves >> moveString; ++ply) {
+                MoveList legal;
+                pos.generateMoves(legal);
+                Move move(moveString);
+                auto found = find(legal.begin(), legal.end(), move);
+                if (found == legal.end()) {
+                    cerr << "Illegal move " << moveString << " in game " << read + 1 << endl;
+                    break;
+                }
+                ++counts[{pos.hash(), move.getCode()}];
+                undoType undo;
+                pos.play(move, undo);
+            }
+            ++read;
+        }
+        
+        vector<bookEntryType> entries;
+        entries.push_back({0, 0, 0});
+        memcpy(&entries[0], "CKBK", 4);
+        for (auto && count : counts) {
+            entries.push_back({count.first.first, count.first.second, count.second});
+        }
+        stable_sort(entries.begin() + 1, entries.end(), [](const bookEntryType & a, const bookEntryType & b) {
+            return a.key < b.key || (a.key == b.key && a.weight > b.weight);
+        });
+        
+        ofstream out(file, ios::binary);
+        out.write((const char *) entries.data(), entries.size() * sizeof(bookEntryType));
+        cerr << "Wrote " << entries.size() - 1 << " moves from " << read << " games to " << file << endl;
+    }
+};
+
+OpeningBook book;
+
+
+
+
+
+// What one search thread learns along the way : the line of the previous
+// iteration, killer moves per ply, a history score per from/to pair and
+// cutoff counts. Each thread has its own, so none of it is shared. It is
+// cleared for each move : killers and history carried over from the last
+// search made the next one larger.
+class SearchState {
+
+public:
+    
+    Move _pv[MAX_PLY];
+    int _pvLength;
+    Move _killers[MAX_PLY][2];
+    int _history[32][32];
+    
+    // counters of this thread only, summed by Game once the search is over
+    long long _nodes;
+    long long _cutoffs;
+    long long _firstCutoffs;
+    long long _qnodes;
+    long long _ttProbes;
+    long long _ttHits;
+    long long _plyNodes[MAX_PLY];
+    
+    // clock and table of the game the thread searches for
+    TimeManager * _clock;
+    TranspositionTable * _tt;
+    
+    SearchState() : _clock(nullptr), _tt(&tt) {
+        clear();
+    }
+    
+    void clear() {
+        _pvLength = 0;
+        fill(&_killers[0][0], &_killers[0][0] + 2 * MAX_PLY, Move());
+        fill(&_history[0][0], &_history[0][0] + 32 * 32, 0);
+        _nodes = 0; _cutoffs = 0; _firstCutoffs = 0; _qnodes = 0;
+        _ttProbes = 0; _ttHits = 0;
+        fill(_plyNodes, _plyNodes + MAX_PLY, 0);
+    }
+    
+    void setPv(Move pv[], int length) {
+        copy(pv, pv + length, _pv);
+        _pvLength = length;
+    }
+    
+    // Previous best line first, then the table move, captures by material
+    // won, killers and history
+    void orderMoves(MoveList & moves, Board & board, uint32_t ttMove, int ply) {
+        
+        int scores[MAX_MOVES];
+        for (int i = 0; i < moves.size(); ++i) {
+            Move & move = moves[i];
+            if (ply < _pvLength && move == _pv[ply]) {
+                scores[i] = 1 << 30;
+            } else if ((uint32_t) move.getCode() == ttMove) {
+                scores[i] = 1 << 29;
+            } else if (move.isCapture()) {
+                Bitboard captured = move.captures();
+                int kings = popCount(captured & board.kings());
+                scores[i] = (1 << 28) + WEIGHTS.king * kings + WEIGHTS.man * (popCount(captured) - kings);
+            } else if (move == _killers[ply][0]) {
+                scores[i] = (1 << 27) + 1;
+            } else if (move == _killers[ply][1]) {
+                scores[i] = 1 << 27;
+            } else {
+                scores[i] = _history[move.getFr()][move.getTo()];
+            }
+        }
+        
+        // insertion sort, the lists are short
+        for (int i = 1; i < moves.size(); ++i) {
+            Move move = moves[i];
+            int score = scores[i];
+            int j = i;
+            while (j > 0 && scores[j - 1] < score) {
+                moves[j] = moves[j - 1];
+                scores[j] = scores[j - 1];
+                --j;
+            }
+            moves[j] = move;
+            scores[j] = score;
+        }
+    }
+    
+    void cutoff(Move move, int depth, int ply, bool first) {
+        ++_cutoffs;
+        if (first) ++_firstCutoffs;
+        if (move.isCapture()) return;
+        
+        if (!(move == _killers[ply][0])) {
+            _killers[ply][1] = _killers[ply][0];
+            _killers[ply][0] = move;
+        }
+        
+        int & history = _history[move.getFr()][move.getTo()];
+        history += depth * depth;
+        if (history > (1 << 20)) {
+            for (auto && row : _history) {
+                for (auto && value : row) {
+                    value /= 2;
+                }
+            }
+        }
+    }
+};
+
+
+
+
+
+// Fixed set of threads running submitted tasks, wait() blocks until all the
+// tasks submitted so far are done. A task gets the index of its worker.
+class WorkerPool {
+
+private:
+    
+    vector<thread> _workers;
+    deque<function<void(int)>> _tasks;
+    mutex _mutex;
+    condition_variable _wakeUp;
+    condition_variable _idle;
+    int _pending = 0;
+    bool _quit = false;
+    
+    void work(int worker) {
+        while (1) {
+            function<void(int)> task;
+            {
+                unique_lock<mutex> lock(_mutex);
+                _wakeUp.wait(lock, [this]() { return _quit || !_tasks.empty(); });
+                if (_tasks.empty()) return;
+                task = move(_tasks.front());
+                _tasks.pop_front();
+            }
+            task(worker);
+            {
+                lock_guard<mutex> lock(_mutex);
+                if (--_pending == 0) _idle.notify_all();
+            }
+        }
+    }
+    
+    
+public:
+    
+    WorkerPool(unsigned int threads) {
+        for (unsigned int i = 0; i < threads; ++i) {
+            _workers.push_back(thread(&WorkerPool::work, this, i));
+        }
+    }
+    
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _quit = true;
+        }
+        _wakeUp.notify_all();
+        for (auto && worker : _workers) {
+            worker.join();
+        }
+    }
+    
+    void submit(function<void(int)> task) {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _tasks.push_back(move(task));
+            ++_pending;
         }
-        return captures;
+        _wakeUp.notify_one();
+    }
+    
+    void wait() {
+        unique_lock<mutex> lock(_mutex);
+        _idle.wait(lock, [this]() { return _pending == 0; });
     }
 };
 
@@ -592,6 +1763,35 @@ private:
     minstd_rand0 rng;
     char _turn;
     Board _board;
+    unsigned int _threads = 1;
+    // clock of this game, and the table its searches share, the global one
+    // unless the game was given its own
+    TimeManager _clock;
+    TranspositionTable * _tt = &tt;
+    unique_ptr<TranspositionTable> _ownTable;
+    // main thread first, then one per helper or pool worker
+    vector<SearchState> _states = vector<SearchState>(2);
+    // line expected after the last search, from the position reached by its
+    // first two moves
+    Move _expected[MAX_PLY];
+    int _expectedLength = 0;
+    uint64_t _expectedHash = 0;
+    // last move played, and the thread searching after it
+    Move _played;
+    bool _pondering = true;
+    // the pondering already started the table generation of the next search
+    bool _ponderGeneration = false;
+    thread _ponderer;
+    SearchState _ponderState;
+    // iterations of the last search, and where the statistics are written
+    vector<iterationStatsType> _iterations;
+    ofstream _statsFile;
+    ostream * _statsOutput = &cerr;
+    // log of the iterations on cerr
+    bool _logging = true;
+#ifdef ROOT_SPLIT
+    unique_ptr<WorkerPool> _pool;
+#endif
     
     
 public:
@@ -614,6 +1814,23 @@ public:
         rng.seed(seed);
         
         minstd_rand0 rng = default_random_engine {};
+        bindStates();
+    }
+    
+    // A position given directly, searched quietly
+    Game(const Board & board, char turn) : _turn(turn), _board(board), _logging(false) {
+        rng.seed(1);
+        bindStates();
+    }
+    
+    // A game of the server, the positions come with each request
+    Game(char color) : _turn(color), _logging(false) {
+        rng.seed(std::chrono::system_clock::now().time_since_epoch().count());
+        bindStates();
+    }
+    
+    ~Game() {
+        stopPondering();
     }
     
     
@@ -637,38 +1854,30 @@ public:
         _board.set(7, 3, 'r');
         
         _board.setEvaluation();
-        start = NOW;
+        _clock.start();
         Position pos(_board, 'b');
-        vector<Move> m = pos.generateMoves();
+        MoveList m;
+        pos.generateMoves(m);
         /*/
         cerr << "Playing " << m[3].toString() << endl;
         _board.play(m[3]);
         pos = Position(_board, 'r');
-        m = pos.generateMoves();
+        pos.generateMoves(m);
         /*/
-        vector<string> s;
+        vector<Move> s;
         for (auto && mo : m) {
-            s.push_back(mo.toString());
+            s.push_back(mo);
             pos.play(mo);
             //cerr << mo.toString() << "    \t-->\t" << pos.evaluate() << endl;
             pos = Position(_board, 'b');
         }
-        moveScoreType moveScore = progressiveDeepening(s);
+        progressiveDeepening(s);
         //bestAtDepth(s, 2);
     }
     
     
     void updateBoard() {
-        for (int i = 7; i > -1; --i) {
-            string inputLine; // board line
-            getline(cin, inputLine);
-            for (int j = 0; j < 8; ++j) {
-                if ((i+j)%2 == 0) {
-                    _board.set(i, j, inputLine[j]);
-                }
-            }
-        }
-        _board.setEvaluation();
+        _board.read(cin);
     }
 
 
@@ -677,91 +1886,527 @@ public:
         int legalMoves; // number of legal moves
         cin >> legalMoves; cin.ignore();
         
-        vector<string> movesVect(legalMoves);
+        // moves are parsed here once, and only printed back at the end
+        vector<Move> movesVect;
         
         for (int i = 0; i < legalMoves; i++) {
-            cin >> movesVect[i]; cin.ignore();
+            string moveString;
+            cin >> moveString; cin.ignore();
+            movesVect.push_back(Move(moveString));
         }
         
+        _played = chooseMove(movesVect);
+        cout << _played.toString() << endl;
+    }
+    
+    
+    // Book move or searched move among the legal ones, statistics written
+    Move chooseMove(vector<Move> movesVect) {
+        
+        // random choice between equal moves, bestAtDepth keeps the first
+        shuffle(begin(movesVect), end(movesVect), rng);
+        
+        _iterations.clear();
+        Move bookMove;
+        if (bookChoice(movesVect, bookMove)) {
+            if (_logging) cerr << bookMove.toString() << " from the book at " << int(_clock.elapsed()) << endl;
+            if (_statsOutput) *_statsOutput << "{\"move\":\"" << bookMove.toString() << "\",\"book\":true,\"ms\":" << _clock.elapsed() << "}" << endl;
+            return bookMove;
+        }
         
 #ifdef PROGRESSIVE_DEEPENING   
         moveScoreType moveScore = progressiveDeepening(movesVect);
 #else    
         moveScoreType moveScore = bestAtDepth(movesVect, DEFAULT_DEPTH);
 #endif
-
         
-        cout << moveScore.move << endl;
+        if (_statsOutput) writeStats(moveScore);
+        return moveScore.move;
+    }
+    
+    void setStatsOutput(ostream * output) {
+        _statsOutput = output;
+    }
+    
+    
+    void setStatsFile(const string & file) {
+        _statsFile.open(file, ios::app);
+        _statsOutput = &_statsFile;
+    }
+    
+    
+    // One JSON line per move. The counters of every thread are summed,
+    // helpers included, so it is only called once they have stopped.
+    void writeStats(moveScoreType & moveScore) {
+        
+        long long nodes = 0, qnodes = 0, cutoffs = 0, firstCutoffs = 0, ttProbes = 0, ttHits = 0;
+        long long plyNodes[MAX_PLY] = {};
+        for (auto && state : _states) {
+            nodes += state._nodes;
+            qnodes += state._qnodes;
+            cutoffs += state._cutoffs;
+            firstCutoffs += state._firstCutoffs;
+            ttProbes += state._ttProbes;
+            ttHits += state._ttHits;
+            for (int ply = 0; ply < MAX_PLY; ++ply) {
+                plyNodes[ply] += state._plyNodes[ply];
+            }
+        }
+        int plies = MAX_PLY;
+        while (plies > 0 && !plyNodes[plies - 1]) --plies;
+        
+        // growth of the tree between the last two iterations
+        double branching = 0;
+        int n = _iterations.size();
+        if (n >= 3) {
+            branching = (double) (_iterations[n-1].nodes - _iterations[n-2].nodes) / max(_iterations[n-2].nodes - _iterations[n-3].nodes, 1ll);
+        }
+        
+        ostringstream json;
+        json << "{\"move\":\"" << moveScore.move.toString() << "\",\"score\":" << moveScore.score
+             << ",\"depth\":" << (n ? _iterations.back().depth : 0) << ",\"ms\":" << _clock.elapsed()
+             << ",\"nodes\":" << nodes << ",\"qnodes\":" << qnodes
+             << ",\"cutoffs\":" << cutoffs << ",\"first_cutoff_rate\":" << (cutoffs ? (double) firstCutoffs / cutoffs : 0)
+             << ",\"tt_probes\":" << ttProbes << ",\"tt_hits\":" << ttHits
+             << ",\"ebf\":" << branching << ",\"ponder_nodes\":" << _ponderState._nodes + _ponderState._qnodes
+             << ",\"iterations\":[";
+        for (int i = 0; i < n; ++i) {
+            json << (i ? "," : "") << "{\"depth\":" << _iterations[i].depth << ",\"ms\":" << _iterations[i].ms << ",\"nodes\":" << _iterations[i].nodes << "}";
+        }
+        json << "],\"ply_nodes\":[";
+        for (int ply = 0; ply < plies; ++ply) {
+            json << (ply ? "," : "") << plyNodes[ply];
+        }
+        json << "]}";
+        *_statsOutput << json.str() << endl;
+    }
+    
+    
+    // A legal book move drawn with its weight, false out of the book
+    bool bookChoice(vector<Move> & movesVect, Move & choice) {
+        
+        Position pos(_board, _turn);
+        auto entries = book.probe(pos.hash());
+        uint64_t total = 0;
+        vector<pair<Move, uint64_t>> choices;
+        for (auto entry = entries.first; entry != entries.second; ++entry) {
+            for (auto && move : movesVect) {
+                if (move.getCode() == entry->move) {
+                    choices.push_back({move, entry->weight});
+                    total += entry->weight;
+                }
+            }
+        }
+        if (!total) return false;
+        
+        uint64_t drawn = uniform_int_distribution<uint64_t>(0, total - 1)(rng);
+        for (auto && weighted : choices) {
+            if (drawn < weighted.second) {
+                choice = weighted.first;
+                return true;
+            }
+            drawn -= weighted.second;
+        }
+        return false;
+    }
+    
+    
+    void setThreads(unsigned int threads) {
+        _threads = max(threads, 1u);
+        _states.resize(_threads + 1);
+        bindStates();
+#ifdef ROOT_SPLIT
+        _pool.reset(_threads > 1 ? new WorkerPool(_threads) : nullptr);
+#endif
+    }
+    
+    // A table of its own instead of the global one
+    void setTable(int megabytes) {
+        _ownTable.reset(new TranspositionTable(megabytes));
+        _tt = _ownTable.get();
+        bindStates();
+    }
+    
+    void bindStates() {
+        for (auto && state : _states) {
+            state._clock = &_clock;
+            state._tt = _tt;
+        }
+        _ponderState._clock = &_clock;
+        _ponderState._tt = _tt;
+    }
+    
+    void setPondering(bool pondering) {
+        _pondering = pondering;
+    }
+    
+    TimeManager & clock() {
+        return _clock;
+    }
+    
+    void setBoard(const Board & board) {
+        _board = board;
     }
     
     
-    moveScoreType progressiveDeepening(vector<string> moves) {
+    // Deepens until the clock stops it or maxDepth is reached
+    moveScoreType progressiveDeepening(vector<Move> moves, int maxDepth = MAX_PLY - 1) {
         
         int depth = 0;
+        int completed = 0;
+        
+        // only the table is kept from the last search, and its line leads
+        // when the reply it expected was played
+        if (!_ponderGeneration) _tt->newSearch();
+        _ponderGeneration = false;
+        for (auto && state : _states) {
+            state.clear();
+        }
+        if (_expectedLength && _board.hash() == _expectedHash) {
+            auto expected = find(moves.begin(), moves.end(), _expected[0]);
+            if (expected != moves.end()) {
+                rotate(moves.begin(), expected, expected + 1);
+                for (int i = 0; i < rootStates(); ++i) {
+                    _states[i].setPv(_expected, _expectedLength);
+                }
+            }
+        }
+        _expectedLength = 0;
         moveScoreType bestMoveScore = {moves[0], -INFINITY};
         
-        try {
-            while(1) {
-                bestMoveScore = bestAtDepth(moves, ++depth);
-                int timeUsed = std::chrono::duration_cast<std::chrono::milliseconds>(NOW - start).count();
-                cerr << bestMoveScore.move << " is best at depth " << depth << " with score " << bestMoveScore.score << " reached in " << timeUsed << endl;
-                if (abs(bestMoveScore.score) == INFINITY) throw "Gameover";
+        // Lazy SMP : helpers search the same tree and share the transposition
+        // table, the move is still chosen by this thread
+        vector<thread> helpers;
+#ifndef ROOT_SPLIT
+        for (unsigned int id = 1; id < _threads; ++id) {
+            helpers.push_back(thread(&Game::helperSearch, this, moves, id));
+        }
+#endif
+        
+        // each iteration is expected to last the previous one times the
+        // growth of the last two, and is not started if it would not end
+        double lastTime = 0;
+        double growth = 2;
+        
+        // the moves of a position in the tables all lead into the tables,
+        // one iteration gives their exact scores
+        Position root(_board, _turn);
+        int known;
+        bool solved = tablebase.probe(root, known);
+        while(depth < maxDepth) {
+            if (!_clock.startIteration(lastTime * growth)) {
+                if (_logging) cerr << bestMoveScore.move.toString() << " chosen before depth " << depth + 1 << " at " << int(_clock.elapsed()) << endl;
+                break;
+            }
+            ++depth;
+            double iterationStart = _clock.elapsed();
+            
+            // aspiration window around the previous score, widened on
+            // the side it fails until the score falls inside
+            int delta = ASPIRATION_WINDOW;
+            int low = (depth > 1) ? bestMoveScore.score - delta : -FULL_WINDOW;
+            int high = (depth > 1) ? bestMoveScore.score + delta : FULL_WINDOW;
+            moveScoreType moveScore;
+            while (1) {
+                moveScore = bestAtDepth(moves, depth, low, high);
+                if (_clock.stopped()) break;
+                delta *= 2;
+                if (moveScore.score <= low && low > -FULL_WINDOW) {
+                    low = max(moveScore.score - delta, -FULL_WINDOW);
+                } else if (moveScore.score >= high && high < FULL_WINDOW) {
+                    high = min(moveScore.score + delta, FULL_WINDOW);
+                } else {
+                    break;
+                }
+            }
+            
+            // an unfinished iteration is thrown away
+            if (_clock.stopped()) {
+                if (_logging) cerr << bestMoveScore.move.toString() << " chosen before depth " << depth << " at " << int(_clock.elapsed()) << endl;
+                break;
             }
-        } catch (...) {
-            int timeUsed = std::chrono::duration_cast<std::chrono::milliseconds>(NOW - start).count();
-            cerr << bestMoveScore.move << " chosen before depth " << depth << " at " << timeUsed << endl;
-            return bestMoveScore;
+            bestMoveScore = moveScore;
+            completed = depth;
+            
+            double iterationTime = _clock.elapsed() - iterationStart;
+            if (lastTime > 0) {
+                growth = min(max(iterationTime / lastTime, 1.5), 4.0);
+            }
+            lastTime = iterationTime;
+            _iterations.push_back({depth, _clock.elapsed(), rootNodes()});
+            
+            if (_logging) cerr << bestMoveScore.move.toString() << " is best at depth " << depth << " with score " << bestMoveScore.score << " reached in " << int(_clock.elapsed()) << cutoffStats() << endl;
+            if (abs(bestMoveScore.score) == INFINITY || solved) break;
+            
+            // the best line leads the next iteration
+            auto best = find(moves.begin(), moves.end(), bestMoveScore.move);
+            rotate(moves.begin(), best, best + 1);
+            Move pv[MAX_PLY];
+            int length = principalVariation(bestMoveScore.move, depth, pv);
+            for (int i = 0; i < rootStates(); ++i) {
+                _states[i].setPv(pv, length);
+            }
+        }
+        
+        _clock.stop();
+        for (auto && helper : helpers) {
+            helper.join();
+        }
+        
+        Move pv[MAX_PLY];
+        int length = completed ? principalVariation(bestMoveScore.move, completed, pv) : 0;
+        if (length > 2) {
+            Board expected = _board;
+            expected.play(pv[0]);
+            expected.play(pv[1]);
+            _expectedHash = expected.hash();
+            _expectedLength = length - 2;
+            copy(pv + 2, pv + length, _expected);
+        }
+        return bestMoveScore;
+    }
+    
+    
+    // States only used inside bestAtDepth, which can be read and written
+    // between two iterations. Lazy SMP helpers keep running meanwhile.
+    int rootStates() {
+#ifdef ROOT_SPLIT
+        return _states.size();
+#else
+        return 1;
+#endif
+    }
+    
+    
+    // Depth of the last finished iteration
+    int searchedDepth() {
+        return _iterations.empty() ? 0 : _iterations.back().depth;
+    }
+    
+    
+    // Nodes of the states used at the root, exact between two iterations
+    long long rootNodes() {
+        long long nodes = 0;
+        for (int i = 0; i < rootStates(); ++i) {
+            nodes += _states[i]._nodes + _states[i]._qnodes;
         }
+        return nodes;
     }
     
     
+    string cutoffStats() {
+        long long nodes = 0, qnodes = 0, cutoffs = 0, firstCutoffs = 0;
+        for (int i = 0; i < rootStates(); ++i) {
+            nodes += _states[i]._nodes;
+            qnodes += _states[i]._qnodes;
+            cutoffs += _states[i]._cutoffs;
+            firstCutoffs += _states[i]._firstCutoffs;
+        }
+        return ", " + to_string(nodes) + " nodes, " + to_string(qnodes) + " quiescence nodes, " + to_string(cutoffs ? 100 * firstCutoffs / cutoffs : 0) + "% first move cutoffs";
+    }
     
     
-    moveScoreType bestAtDepth(vector<string> movesVect, int depth) {
+    // Follows the best moves stored in the table, starting with first
+    int principalVariation(Move first, int depth, Move pv[]) {
         
-        int bestScore = -INFINITY;
-        vector<string> bestMoveVect;
+        Position pos(_board, _turn);
+        Move move = first;
+        int length = 0;
         
-        for(auto && moveString : movesVect) {
-            Move move(moveString);
-            
-            Position pos(_board, _turn);
+        while (length < depth) {
+            pv[length++] = move;
             pos.play(move);
             
-
-
-#ifdef ALPHABETA
-
-        //a = max(a, -alphabeta(p, depth - 1, -b, -a));
-            int score = -alphabeta(pos, depth - 1, -INFINITY, INFINITY);
-#else
-            int score = -minimax(pos, depth - 1);
+            ttEntryType entry;
+            if (!_tt->probe(pos.hash(), entry)) break;
+            
+            MoveList moves;
+            pos.generateMoves(moves);
+            auto next = find_if(moves.begin(), moves.end(), [&](Move & m) { return (uint32_t) m.getCode() == entry.move; });
+            if (next == moves.end()) break;
+            move = *next;
+        }
+        return length;
+    }
+    
+    
+    // The position after the move played is searched in the background
+    // until the next board is read. Every reply of the opponent is searched
+    // at increasing depths, the expected one first, and the shared table
+    // keeps the results for the next move.
+    void startPondering() {
+        if (!_pondering || _played.steps() == 0) return;
+        Board board = _board;
+        board.play(_played);
+        _tt->newSearch();
+        _ponderGeneration = true;
+        _clock.ponder();
+        _ponderer = thread(&Game::ponderSearch, this, board, oppositeColor(_turn));
+    }
+    
+    void stopPondering() {
+        if (!_ponderer.joinable()) return;
+        _clock.stop();
+        _ponderer.join();
+        cerr << "Pondered " << _ponderState._nodes + _ponderState._qnodes << " nodes" << endl;
+    }
+    
+    void ponderSearch(Board board, char turn) {
+        
+        Position pos(board, turn);
+        MoveList replies;
+        pos.generateMoves(replies);
+        _ponderState.clear();
+        
+        ttEntryType entry;
+        if (_tt->probe(pos.hash(), entry)) {
+            for (int i = 0; i < replies.size(); ++i) {
+                if ((uint32_t) replies[i].getCode() == entry.move) {
+                    swap(replies[0], replies[i]);
+                }
+            }
+        }
+        
+        for (int depth = 1; depth < MAX_PLY - 1 && !_clock.stopped(); ++depth) {
+            for (auto && reply : replies) {
+                undoType undo;
+                pos.play(reply, undo);
+                alphabeta(pos, depth, -FULL_WINDOW, FULL_WINDOW, _ponderState, 1);
+                pos.undo(reply, undo);
+                if (_clock.stopped()) break;
+            }
+        }
+    }
+    
+    
+    // Iterative deepening on a private position, only to fill the shared
+    // table. Odd helpers start one ply deeper, and each helper starts the
+    // root moves at a different offset.
+    void helperSearch(vector<Move> moves, unsigned int id) {
+        
+        Position pos(_board, _turn);
+        rotate(moves.begin(), moves.begin() + id % moves.size(), moves.end());
+        
+        for (int depth = 1 + id % 2; depth < MAX_PLY - 1 && !_clock.stopped(); ++depth) {
+            int a = -FULL_WINDOW;
+            for (auto && move : moves) {
+                undoType undo;
+                pos.play(move, undo);
+                a = max(a, -alphabeta(pos, depth - 1, -FULL_WINDOW, -a, _states[id], 1));
+                pos.undo(move, undo);
+                if (_clock.stopped()) break;
+            }
+        }
+    }
+    
+    
+    
+    
+    // Best root move for the window (low, high), a score outside of it is
+    // only a bound. Only the first move and the moves beating alpha get an
+    // exact score. Among equal moves the first one in root order is kept,
+    // printMove shuffles the root moves so that the choice stays random.
+    moveScoreType bestAtDepth(vector<Move> & movesVect, int depth, int low = -FULL_WINDOW, int high = FULL_WINDOW) {
+        
+        // moves left with a bound only are never picked
+        vector<int> scores(movesVect.size(), -FULL_WINDOW - 1);
+        
+#ifdef ROOT_SPLIT
+        if (_pool) {
+            rootSplit(movesVect, depth, low, high, scores);
+        } else
 #endif
+        {
+            Position pos(_board, _turn);
+            int alpha = low;
+            for (size_t i = 0; i < movesVect.size(); ++i) {
+                int score = searchRootMove(pos, movesVect[i], depth, alpha, high, i == 0, _states[0]);
+                if (_clock.stopped()) break;
+                if (i == 0 || score > alpha) {
+                    scores[i] = score;
+                }
+                alpha = max(alpha, score);
+            }
+        }
+        
+        size_t best = 0;
+        for (size_t i = 0; i < movesVect.size(); ++i) {
         
 #ifdef TESTING_BOARD
-            cerr << moveString << " --> " << score << " " << bestScore << endl;
+            cerr << movesVect[i].toString() << " --> " << scores[i] << " " << scores[best] << endl;
 #endif
 
-            if (score == bestScore) {
-                bestMoveVect.push_back(move.toString());
-            }
-            
-            else if (score > bestScore) {
-                bestScore = score;
-                bestMoveVect = {move.toString()};
+            if (scores[i] > scores[best]) {
+                best = i;
             }
         }
 
-#ifdef TESTING_BOARD
-        cerr << "Selected moves : " << endl;
-        for (auto && el : bestMoveVect) {
-            cerr << el << endl;
+        return {movesVect[best], scores[best]};
+    }
+    
+    
+    // Score of a root move. Apart from the first move, a zero window test
+    // tells whether the move beats alpha, and only then is it searched
+    // again for its exact score.
+    int searchRootMove(Position & pos, Move move, int depth, int alpha, int high, bool first, SearchState & state) {
+        
+        undoType undo;
+        pos.play(move, undo);
+        
+#ifdef ALPHABETA
+        int score;
+        if (first) {
+            score = -alphabeta(pos, depth - 1, -high, -alpha, state, 1);
+        } else {
+            score = -alphabeta(pos, depth - 1, -alpha - 1, -alpha, state, 1);
+            if (score > alpha && score < high) {
+                score = -alphabeta(pos, depth - 1, -high, -alpha, state, 1);
+            }
         }
+#else
+        int score = -minimax(pos, depth - 1, state);
 #endif
-
-        shuffle(begin(bestMoveVect), end(bestMoveVect), rng);
-        return {bestMoveVect[0], bestScore};
+        
+        pos.undo(move, undo);
+        return score;
+    }
+    
+    
+#ifdef ROOT_SPLIT
+    // The first root move is searched alone, the others are handed to the
+    // pool with the best score so far as a shared alpha. Scores are merged
+    // in root order by bestAtDepth, so equal moves are not picked by which
+    // worker finished first. The scores themselves are not reproducible :
+    // the workers share the table, and their own killers and history steer
+    // the late move reductions, so a move may score differently from one
+    // run to the next. Only the serial search gives a fixed result.
+    void rootSplit(vector<Move> & movesVect, int depth, int low, int high, vector<int> & scores) {
+        
+        Position pos(_board, _turn);
+        scores[0] = searchRootMove(pos, movesVect[0], depth, low, high, true, _states[0]);
+        
+        // a late move is searched just below the shared alpha and kept if it
+        // reaches it : the alpha never passes the best score, so every move
+        // tying the best gets its exact score whatever the other workers did,
+        // and the tie goes to root order
+        atomic<int> alpha(max(low, scores[0]));
+        
+        for (size_t i = 1; i < movesVect.size(); ++i) {
+            _pool->submit([&, i](int worker) {
+                if (_clock.stopped()) return;
+                Position p(_board, _turn);
+                int current = alpha;
+                int score = searchRootMove(p, movesVect[i], depth, current - 1, high, false, _states[1 + worker]);
+                if (_clock.stopped()) return;
+                if (score >= current) {
+                    scores[i] = score;
+                }
+                while (score > current && !alpha.compare_exchange_weak(current, score)) {}
+            });
+        }
+        _pool->wait();
     }
+#endif
     
 };
 
@@ -770,16 +2415,14 @@ public:
 
 
 
-int minimax(Position currentPosition, int depth) {
+int minimax(Position & currentPosition, int depth, SearchState & state) {
     
 #ifdef PROGRESSIVE_DEEPENING
-        int timeUsed = std::chrono::duration_cast<std::chrono::milliseconds>(NOW - start).count();
-        if (timeUsed > 99) {
-            throw "Timeout";
-        }
+    if (state._clock->poll()) return 0;
 #endif
     
-    vector<Move> moves = currentPosition.generateMoves();
+    MoveList moves;
+    currentPosition.generateMoves(moves);
     
     if (moves.empty()) {
         cerr << "GAME OVER" << endl;
@@ -792,9 +2435,11 @@ int minimax(Position currentPosition, int depth) {
     
     int score = -INFINITY;
     for (auto && move : moves) {
-        Position p(currentPosition);
-        p.play(move);
-        score = max(score, -minimax(p, depth - 1));
+        undoType undo;
+        currentPosition.play(move, undo);
+        score = max(score, -minimax(currentPosition, depth - 1, state));
+        currentPosition.undo(move, undo);
+        if (state._clock->stopped()) return 0;
     }
     
     return score;
@@ -802,34 +2447,166 @@ int minimax(Position currentPosition, int depth) {
 
 
 
-int alphabeta(Position currentPosition, int depth, int a, int b) {
+int alphabeta(Position & currentPosition, int depth, int a, int b, SearchState & state, int ply) {
     
 #ifdef PROGRESSIVE_DEEPENING
-        int timeUsed = std::chrono::duration_cast<std::chrono::milliseconds>(NOW - start).count();
-        if (timeUsed > 99) {
-            throw "Timeout";
-        }
+    if (state._clock->poll()) return 0;
+#endif
+    
+    int known;
+    if (tablebase.probe(currentPosition, known)) {
+        return known;
+    }
+    
+#ifdef QUIESCENCE
+    if (depth <= 0) {
+        return quiescence(currentPosition, a, b, state, ply);
+    }
 #endif
     
-    vector<Move> moves = currentPosition.generateMoves();
+    ++state._nodes;
+    ++state._plyNodes[ply];
+    
+    uint64_t key = currentPosition.hash();
+    ttEntryType entry;
+    bool found = depth > 0 && state._tt->probe(key, entry);
+    state._ttProbes += depth > 0;
+    state._ttHits += found;
+    
+    if (found && entry.depth >= depth) {
+        int score = TranspositionTable::fromTable(entry.score, depth);
+        if (entry.bound == TT_EXACT) return score;
+        if (entry.bound == TT_LOWER && score >= b) return score;
+        if (entry.bound == TT_UPPER && score <= a) return score;
+    }
+    
+    MoveList moves;
+#ifdef UNIQUE_CAPTURES
+    currentPosition.generateMoves(moves, true);
+#else
+    currentPosition.generateMoves(moves);
+#endif
     
     if (moves.empty()) {
         return -INFINITY-depth;
     }
     
-    if (depth <= 0) {
+    if (depth <= 0 || ply >= MAX_PLY - 1) {
         return currentPosition.evaluate();
     }
     
-    for (auto && move : moves) {
-        Position p(currentPosition);
-        p.play(move);
-        a = max(a, -alphabeta(p, depth - 1, -b, -a));
+    bool quiet = !moves[0].isCapture();
+    
+#ifdef FUTILITY
+    bool zeroWindow = b - a == 1;
+    if (quiet && zeroWindow && depth <= 2 && abs(a) < TB_WIN / 2) {
+        int eval = currentPosition.evaluate();
+        if (depth == 1 && eval + currentPosition._board.menValue(FUTILITY_MARGIN) <= a) return eval;
+        if (depth == 2 && eval + currentPosition._board.menValue(RAZOR_MARGIN) <= a) depth = 1;
+    }
+#endif
+    
+    state.orderMoves(moves, currentPosition._board, found ? entry.move : 0, ply);
+    
+    int alpha = a;
+    Move bestMove;
+    for (int i = 0; i < moves.size(); ++i) {
+        Move move = moves[i];
+        undoType undo;
+        currentPosition.play(move, undo);
+        
+        // principal variation search : zero window for all but the first
+        // move, searched again when one of them lands inside (a, b)
+        int score;
+        if (i == 0) {
+            score = -alphabeta(currentPosition, depth - 1, -b, -a, state, ply + 1);
+        } else {
+            int reduction = 0;
+#ifdef LATE_MOVE_REDUCTIONS
+            // neither killers nor promotions are reduced
+            if (quiet && depth >= LMR_DEPTH && i >= LMR_MOVES
+                && !undo.crowned && !(move == state._killers[ply][0]) && !(move == state._killers[ply][1])) {
+                reduction = LMR_REDUCTION;
+            }
+#endif
+            score = -alphabeta(currentPosition, depth - 1 - reduction, -a - 1, -a, state, ply + 1);
+            if (reduction && score > a) {
+                score = -alphabeta(currentPosition, depth - 1, -a - 1, -a, state, ply + 1);
+            }
+            if (score > a && score < b) {
+                score = -alphabeta(currentPosition, depth - 1, -b, -a, state, ply + 1);
+            }
+        }
+        currentPosition.undo(move, undo);
+        // the search was stopped, nothing below can be trusted
+        if (state._clock->stopped()) return 0;
+        if (score > a) {
+            a = score;
+            bestMove = move;
+        }
         if (a >= b) {
             //cerr << "Pruning at depth " << depth << endl;
+            state.cutoff(move, depth, ply, i == 0);
+            break;
+        }
+    }
+    
+    int bound = (a >= b) ? TT_LOWER : (a > alpha) ? TT_EXACT : TT_UPPER;
+    state._tt->store(key, depth, bound, TranspositionTable::toTable(a, depth), bestMove);
+    return a;
+}
+
+
+// Leaves of alphabeta. A position is only evaluated once the side to move
+// has no capture left : captures are mandatory, so there is no standing pat
+// while one is pending, and the sequence always ends as pieces disappear.
+int quiescence(Position & currentPosition, int a, int b, SearchState & state, int ply) {
+    
+#ifdef PROGRESSIVE_DEEPENING
+    if (state._clock->poll()) return 0;
+#endif
+    
+    ++state._qnodes;
+    ++state._plyNodes[ply];
+    
+    int known;
+    if (tablebase.probe(currentPosition, known)) {
+        return known;
+    }
+    
+    MoveList moves;
+#ifdef UNIQUE_CAPTURES
+    currentPosition.generateMoves(moves, true);
+#else
+    currentPosition.generateMoves(moves);
+#endif
+    
+    if (moves.empty()) {
+        return -INFINITY;
+    }
+    
+    if (!moves[0].isCapture() || ply >= MAX_PLY - 1) {
+        return currentPosition.evaluate();
+    }
+    
+    if (moves.size() > 1) {
+        state.orderMoves(moves, currentPosition._board, 0, ply);
+    }
+    
+    for (auto && move : moves) {
+        undoType undo;
+        currentPosition.play(move, undo);
+        int score = -quiescence(currentPosition, -b, -a, state, ply + 1);
+        currentPosition.undo(move, undo);
+        if (state._clock->stopped()) return 0;
+        if (score > a) {
+            a = score;
+        }
+        if (a >= b) {
             break;
         }
     }
+    
     return a;
 }
 
@@ -852,26 +2629,681 @@ char oppositeColor(char c) {
 
 
 
-int main()
-{
+// Leaf nodes at depth, the last ply is counted without being played
+long long perft(Position & position, int depth) {
     
-    Game game;
+    MoveList moves;
+    position.generateMoves(moves);
+    
+    if (depth <= 1) {
+        return (depth == 1) ? moves.size() : 1;
+    }
+    
+    long long nodes = 0;
+    for (auto && move : moves) {
+        undoType undo;
+        position.play(move, undo);
+        nodes += perft(position, depth - 1);
+        position.undo(move, undo);
+    }
+    return nodes;
+}
 
-#ifdef TESTING_BOARD
+
+
+// perft <depth> [threads] : counts the leaves below each root move (divide)
+// then prints the total and the speed. The position is read from stdin in
+// the referee format (color, then the board), or is the starting position
+// with red to move when stdin is empty.
+void perftMode(int depth, int threads) {
     
-    game.testBoard();
+    Board board;
+    string color;
+    getline(cin, color);
+    if (color == "r" || color == "b") {
+        board.read(cin);
+    } else {
+        color = "r";
+        board.setStart();
+    }
+    Position root(board, color[0]);
+    
+    MoveList moves;
+    root.generateMoves(moves);
+    vector<long long> counts(moves.size(), 0);
+    atomic<int> next(0);
+    
+    auto now = std::chrono::steady_clock::now();
+    
+    // each thread takes the next root move until there is none left
+    auto worker = [&]() {
+        Position position(root);
+        int i;
+        while ((i = next++) < moves.size()) {
+            undoType undo;
+            position.play(moves[i], undo);
+            counts[i] = perft(position, depth - 1);
+            position.undo(moves[i], undo);
+        }
+    };
+    
+    vector<thread> pool;
+    for (int t = 1; t < threads; ++t) {
+        pool.push_back(thread(worker));
+    }
+    worker();
+    for (auto && t : pool) {
+        t.join();
+    }
+    
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - now).count();
+    
+    long long nodes = 0;
+    for (int i = 0; i < moves.size(); ++i) {
+        cout << moves[i].toString() << " : " << counts[i] << endl;
+        nodes += counts[i];
+    }
+    if (depth <= 0) nodes = 1;
+    
+    cout << "perft " << depth << " : " << nodes << " nodes in " << (int) (seconds * 1000) << " ms, "
+         << (long long) (nodes / max(seconds, 1e-9)) << " nodes/s on " << threads << " threads" << endl;
+}
 
-#else
 
+
+
+
+// Texel tuning. Positions come one per line as the 32 squares, the side
+// to move and the result of the game for red (1, 0.5 or 0). The weights
+// minimizing the squared error between the results and a sigmoid of the
+// evaluation are printed as defines, the man value stays the unit.
+void tuneMode(istream & input) {
+    
+    evalBatchType batch;
+    vector<double> results;
+    string squares;
+    char turn;
+    double result;
+    while (input >> squares >> turn >> result) {
+        if (squares.size() != 32) continue;
+        Board board;
+        board.setSquares(squares);
+        if (board.features()[3] == 0) continue;
+        batch.push(board);
+        results.push_back(result);
+    }
+    if (results.empty()) {
+        cerr << "No position to tune on" << endl;
+        return;
+    }
+    
+    vector<int32_t> evals(batch.size());
+    long long evaluated = 0;
+    auto now = chrono::steady_clock::now();
+    auto error = [&](const weightsType & w, double k) {
+        evaluateBatch(w, batch, evals.data());
+        evaluated += batch.size();
+        double sum = 0;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            double predicted = 1 / (1 + exp(-k * evals[i]));
+            sum += (results[i] - predicted) * (results[i] - predicted);
+        }
+        return sum / batch.size();
+    };
+    
+    // scale of the sigmoid, searched on a log scale for the current weights
+    double low = log(1e-4), high = log(10.0);
+    for (int i = 0; i < 60; ++i) {
+        double a = low + (high - low) / 3, b = high - (high - low) / 3;
+        if (error(WEIGHTS, exp(a)) < error(WEIGHTS, exp(b))) high = b; else low = a;
+    }
+    double k = exp((low + high) / 2);
+    
+    weightsType w = WEIGHTS;
+    double best = error(w, k);
+    cerr << results.size() << " positions, scale " << k << ", error " << best << endl;
+    for (int step = 16; step >= 1; step /= 2) {
+        bool improved = true;
+        while (improved) {
+            improved = false;
+            for (int * weight : {&w.king, &w.center}) {
+                for (int delta : {step, -step}) {
+                    *weight += delta;
+                    double e = error(w, k);
+                    if (e < best) {
+                        best = e;
+                        improved = true;
+                    } else {
+                        *weight -= delta;
+                    }
+                }
+            }
+        }
+        cerr << "step " << step << " : king " << w.king << ", center " << w.center << ", error " << best << endl;
+    }
+    
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - now).count();
+    cerr << (long long) (evaluated / max(seconds, 1e-9)) << " evaluations/s" << endl;
+    cout << "#define KING_VALUE " << w.king << endl;
+    cout << "#define MAN_VALUE " << w.man << endl;
+    cout << "#define CENTER_VALUE " << w.center << endl;
+}
+
+
+
+
+
+// Analysis of a file of positions, one per line as the 32 squares and the
+// side to move. Each position gets its own search to a depth or a number
+// of nodes, over a pool of threads sharing the table. Results are printed
+// as soon as they are known : the line number, the position, the best
+// move, its score, the depth reached, the nodes and the ms.
+void analysisMode(istream & input, int depth, long long nodes, unsigned int threads) {
+    
+    mutex lock;
+    WorkerPool pool(threads);
+    string squares;
+    char turn;
+    for (int line = 1; input >> squares >> turn; ++line) {
+        pool.submit([&, line, squares, turn](int) {
+            
+            Board board;
+            board.setSquares(squares);
+            Position pos(board, turn);
+            MoveList moves;
+            pos.generateMoves(moves);
+            
+            auto start = chrono::steady_clock::now();
+            moveScoreType result = {Move(), -INFINITY};
+            Game game(board, turn);
+            // the nodes are counted by the clock, which stops the search
+            // inside an iteration and keeps the last one completed
+            game.clock().setBudget(1e12, 0);
+            game.clock().setNodeLimit(nodes);
+            game.clock().start();
+            if (!moves.empty()) {
+                result = game.progressiveDeepening(vector<Move>(moves.begin(), moves.end()), depth);
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            
+            lock_guard<mutex> guard(lock);
+            cout << line << ' ' << squares << ' ' << turn << ' ' << (moves.empty() ? "none" : result.move.toString()) << ' ' << result.score
+                 << ' ' << game.searchedDepth() << ' ' << game.rootNodes() << ' ' << (int) ms << endl;
+        });
+    }
+    pool.wait();
+}
+
+
+
+// Many games served by one process, one request per line starting with the
+// id of its game :
+//   <id> new <color> [ms]        starts a game, ms per move
+//   <id> move <32 squares>       searches the position, <color> to move
+//   <id> quit                    ends the game
+// A move request is answered by "<id> <move>", or "<id> none" when there is
+// no legal move, in the order the searches end. Bad requests get
+// "<id> error <reason>". Each game has its own clock and table, the
+// searches run one thread each over a shared pool.
+struct serverGameType {
+    unique_ptr<Game> game;
+    char color;
+    atomic<bool> busy;
+    atomic<bool> cancelled;
+};
+
+void serverMode(istream & input, unsigned int threads) {
+    
+    mutex lock;
+    // shared with the search of the game, which ends a game quit under it
+    map<string, shared_ptr<serverGameType>> games;
+    WorkerPool pool(threads);
+    
+    auto reply = [&](const string & id, const string & text) {
+        lock_guard<mutex> guard(lock);
+        cout << id << ' ' << text << endl;
+    };
+    
+    string line;
+    while (getline(input, line)) {
+        istringstream request(line);
+        string id, command;
+        if (!(request >> id >> command)) continue;
+        auto found = games.find(id);
+        
+        if (command == "new") {
+            string color;
+            double budget = MOVE_BUDGET;
+            request >> color >> budget;
+            if (found != games.end()) { reply(id, "error game exists"); continue; }
+            if (color != "r" && color != "b") { reply(id, "error wrong color"); continue; }
+            shared_ptr<serverGameType> entry(new serverGameType());
+            entry->color = color[0];
+            entry->busy = false;
+            entry->cancelled = false;
+            entry->game.reset(new Game(entry->color));
+            entry->game->setTable(SERVER_TT_MEGABYTES);
+            entry->game->setStatsOutput(nullptr);
+            entry->game->clock().setBudget(budget, TIME_MARGIN);
+            games[id] = entry;
+            
+        } else if (command == "move") {
+            string squares;
+            request >> squares;
+            if (found == games.end()) { reply(id, "error no game"); continue; }
+            if (squares.size() != 32) { reply(id, "error wrong position"); continue; }
+            shared_ptr<serverGameType> entry = found->second;
+            if (entry->busy.exchange(true)) { reply(id, "error busy"); continue; }
+            
+            pool.submit([&reply, entry, id, squares](int) {
+                // the time is counted once a worker takes the search, the
+                // game may have been quit while it waited
+                entry->game->clock().start();
+                if (entry->cancelled) return;
+                Board board;
+                board.setSquares(squares);
+                Position pos(board, entry->color);
+                MoveList moves;
+                pos.generateMoves(moves);
+                
+                string answer = "none";
+                if (!moves.empty()) {
+                    entry->game->setBoard(board);
+                    answer = entry->game->chooseMove(vector<Move>(moves.begin(), moves.end())).toString();
+                }
+                if (!entry->cancelled) reply(id, answer);
+                entry->busy = false;
+            });
+            
+        } else if (command == "quit") {
+            if (found == games.end()) { reply(id, "error no game"); continue; }
+            // a search under way is cut short, the game goes with it
+            found->second->cancelled = true;
+            found->second->game->clock().stop();
+            games.erase(found);
+            
+        } else {
+            reply(id, "error unknown command");
+        }
+    }
+    pool.wait();
+}
+
+
+// Search statistics read from the log of an engine
+struct searchStatsType {
+    long long nodes;
+    double ms;      // wall time of the moves searched
+    long long depth;
+    long long searches;
+};
+
+// An engine started as a child process. Its stdin and stdout carry the
+// referee protocol, and its log on stderr gives the search statistics.
+class EngineProcess {
+
+private:
+    
+    pid_t _pid;
+    int _in;
+    int _out;
+    int _err;
+    string _pending;
+    string _log;
+    
+    
+public:
+    
+    EngineProcess(const string & command, char color) : _pid(-1), _in(-1), _out(-1), _err(-1) {
+        
+        istringstream words(command);
+        vector<string> args;
+        string word;
+        while (words >> word) args.push_back(word);
+        vector<char *> argv;
+        for (auto && arg : args) argv.push_back(&arg[0]);
+        argv.push_back(nullptr);
+        
+        // close on exec, so that the other engines do not keep them open
+        int in[2], out[2], err[2];
+        if (argv.size() < 2 || pipe2(in, O_CLOEXEC) || pipe2(out, O_CLOEXEC) || pipe2(err, O_CLOEXEC)) return;
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, in[0], 0);
+        posix_spawn_file_actions_adddup2(&actions, out[1], 1);
+        posix_spawn_file_actions_adddup2(&actions, err[1], 2);
+        if (posix_spawnp(&_pid, argv[0], &actions, nullptr, argv.data(), environ)) _pid = -1;
+        posix_spawn_file_actions_destroy(&actions);
+        close(in[0]); close(out[1]); close(err[1]);
+        _in = in[1]; _out = out[0]; _err = err[0];
+        fcntl(_err, F_SETFL, O_NONBLOCK);
+        
+        send(string(1, color) + "\n");
+    }
+    
+    ~EngineProcess() {
+        if (_pid > 0) {
+            kill(_pid, SIGKILL);
+            waitpid(_pid, nullptr, 0);
+        }
+        close(_in); close(_out); close(_err);
+    }
+    
+    bool send(const string & text) {
+        size_t done = 0;
+        while (done < text.size()) {
+            ssize_t n = write(_in, text.data() + done, text.size() - done);
+            if (n <= 0) return false;
+            done += n;
+        }
+        return true;
+    }
+    
+    // Next line of the engine, false if it has not come within timeout ms
+    bool readLine(string & line, int timeout) {
+        auto start = chrono::steady_clock::now();
+        size_t end;
+        while ((end = _pending.find('\n')) == string::npos) {
+            int left = timeout - (int) chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            pollfd fd = {_out, POLLIN, 0};
+            if (left <= 0 || poll(&fd, 1, left) <= 0) return false;
+            char buffer[4096];
+            ssize_t n = read(_out, buffer, sizeof(buffer));
+            if (n <= 0) return false;
+            _pending.append(buffer, n);
+        }
+        line = _pending.substr(0, end);
+        _pending.erase(0, end + 1);
+        while (!line.empty() && isspace(line.back())) line.pop_back();
+        return true;
+    }
+    
+    // Adds the statistics line logged since the previous call, for a move
+    // that took ms. The log is written before the move, so it is already in
+    // the pipe.
+    void readStats(searchStatsType & stats, double ms) {
+        char buffer[4096];
+        ssize_t n;
+        while ((n = read(_err, buffer, sizeof(buffer))) > 0) {
+            _log.append(buffer, n);
+        }
+        
+        // number following "key": in a line
+        auto field = [](const string & line, const string & key) {
+            size_t at = line.find("\"" + key + "\":");
+            return (at == string::npos) ? 0 : atoll(line.c_str() + at + key.size() + 3);
+        };
+        
+        long long depth = 0, nodes = 0;
+        bool searched = false;
+        size_t end;
+        while ((end = _log.find('\n')) != string::npos) {
+            string line = _log.substr(0, end);
+            if (line.compare(0, 9, "{\"move\":\"") == 0 && line.find("\"book\"") == string::npos) {
+                depth = field(line, "depth");
+                nodes = field(line, "nodes") + field(line, "qnodes");
+                searched = true;
+            }
+            _log.erase(0, end + 1);
+        }
+        if (searched) {
+            stats.nodes += nodes;
+            stats.ms += ms;
+            stats.depth += depth;
+            ++stats.searches;
+        }
+    }
+};
+
+
+// One game from the start position, after random plies drawn from seed.
+// Returns the score of red, the moves played go to played.
+double matchGame(const string & red, const string & black, unsigned int seed, vector<string> & played, searchStatsType stats[2]) {
+    
+    Board board;
+    board.setStart();
+    Position pos(board, 'r');
+    MoveList moves;
+    
+    mt19937 rng(seed);
+    for (int ply = 0; ply < MATCH_OPENING_PLIES; ++ply) {
+        pos.generateMoves(moves);
+        if (moves.empty()) break;
+        Move move = moves[rng() % moves.size()];
+        played.push_back(move.toString());
+        pos.play(move);
+    }
+    
+    unique_ptr<EngineProcess> engines[2] = {unique_ptr<EngineProcess>(new EngineProcess(red, 'r')), unique_ptr<EngineProcess>(new EngineProcess(black, 'b'))};
+    
+    while (played.size() < MATCH_MAX_PLIES) {
+        int side = (pos._turn == 'r') ? 0 : 1;
+        double lost = side ? 1 : 0;
+        pos.generateMoves(moves);
+        if (moves.empty()) return lost;
+        
+        ostringstream input;
+        pos._board.write(input);
+        input << moves.size() << '\n';
+        for (auto && move : moves) {
+            input << move.toString() << '\n';
+        }
+        
+        string answer;
+        auto start = chrono::steady_clock::now();
+        if (!engines[side]->send(input.str()) || !engines[side]->readLine(answer, MATCH_MOVE_TIMEOUT)) {
+            cerr << (side ? "black" : "red") << " engine did not answer" << endl;
+            return lost;
+        }
+        auto move = find_if(moves.begin(), moves.end(), [&](Move & m) { return m.toString() == answer; });
+        if (move == moves.end()) {
+            cerr << (side ? "black" : "red") << " engine played an illegal move : " << answer << endl;
+            return lost;
+        }
+        engines[side]->readStats(stats[side], chrono::duration<double, milli>(chrono::steady_clock::now() - start).count());
+        played.push_back(answer);
+        pos.play(*move);
+    }
+    return 0.5;
+}
+
+
+// Games between engines a and b over as many games at once as asked. Each
+// opening is played twice, the engines taking both colors. The score of a
+// is given as an Elo difference with its 95% interval.
+//
+// The engines must run with "-j 1 -p 0" : one thread and no pondering, so
+// that the games running side by side do not share the cores and each
+// engine only searches on its own time and nodes.
+bool isolatedEngine(const string & command) {
+    istringstream words(command);
+    string word, value;
+    bool oneThread = false, noPonder = false;
+    while (words >> word) {
+        if ((word == "-j" || word == "-p") && words >> value) {
+            if (word == "-j") oneThread = value == "1";
+            else noPonder = value == "0";
+        }
+    }
+    return oneThread && noPonder;
+}
+
+void matchMode(const string & a, const string & b, int games, int concurrency, const string & gamesFile) {
+    
+    for (auto && engine : {a, b}) {
+        if (!isolatedEngine(engine)) {
+            cerr << "Engine " << engine << " must run with -j 1 -p 0" << endl;
+            return;
+        }
+    }
+    
+    signal(SIGPIPE, SIG_IGN);
+    mutex lock;
+    int wins = 0, draws = 0, losses = 0;
+    searchStatsType stats[2] = {};
+    ofstream out;
+    if (!gamesFile.empty()) out.open(gamesFile);
+    atomic<int> next(0);
+    
+    auto worker = [&]() {
+        int g;
+        while ((g = next++) < games) {
+            bool aRed = g % 2 == 0;
+            vector<string> played;
+            searchStatsType sides[2] = {};
+            double red = matchGame(aRed ? a : b, aRed ? b : a, g / 2 + 1, played, sides);
+            double score = aRed ? red : 1 - red;
+            
+            lock_guard<mutex> guard(lock);
+            (score == 1 ? wins : score == 0 ? losses : draws)++;
+            for (int side = 0; side < 2; ++side) {
+                searchStatsType & total = stats[(side == 0) == aRed ? 0 : 1];
+                total.nodes += sides[side].nodes;
+                total.ms += sides[side].ms;
+                total.depth += sides[side].depth;
+                total.searches += sides[side].searches;
+            }
+            if (out.is_open()) {
+                for (auto && move : played) out << move << ' ';
+                out << endl;
+            }
+            cerr << "Game " << g + 1 << " : " << score << " in " << played.size() << " plies, "
+                 << wins << " - " << draws << " - " << losses << endl;
+        }
+    };
+    
+    vector<thread> pool;
+    for (int t = 1; t < concurrency; ++t) {
+        pool.push_back(thread(worker));
+    }
+    worker();
+    for (auto && t : pool) {
+        t.join();
+    }
+    
+    int n = wins + draws + losses;
+    double score = (wins + draws / 2.0) / n;
+    double variance = (wins * (1 - score) * (1 - score) + draws * (0.5 - score) * (0.5 - score) + losses * score * score) / n;
+    double margin = 1.96 * sqrt(variance / n);
+    auto elo = [](double s) {
+        s = min(max(s, 1e-6), 1 - 1e-6);
+        return -400 * log10(1 / s - 1);
+    };
+    
+    cout << "Score of " << a << " vs " << b << " : " << wins << " - " << draws << " - " << losses << " (" << score << ")" << endl;
+    cout << "Elo difference : " << (int) round(elo(score)) << " +/- " << (int) round((elo(score + margin) - elo(score - margin)) / 2) << endl;
+    for (int e = 0; e < 2; ++e) {
+        searchStatsType & s = stats[e];
+        cout << (e ? b : a) << " : " << (long long) (s.nodes * 1000 / max(s.ms, 1.0)) << " nodes/s, depth "
+             << (double) s.depth / max(s.searches, 1ll) << " over " << s.searches << " searches" << endl;
+    }
+}
+
+
+
+
+
+int main(int argc, char** argv)
+{
+    
+    if (argc > 1 && string(argv[1]) == "perft") {
+        int depth = (argc > 2) ? atoi(argv[2]) : 6;
+        int threads = (argc > 3) ? atoi(argv[3]) : 1;
+        perftMode(depth, max(threads, 1));
+        return 0;
+    }
+    
+    if (argc > 1 && string(argv[1]) == "tablebase") {
+        int pieces = (argc > 2) ? atoi(argv[2]) : TB_PIECES;
+        tablebase.generate(min(max(pieces, 2), 7), (argc > 3) ? argv[3] : TB_FILE);
+        return 0;
+    }
+    
+    if (argc > 2 && string(argv[1]) == "tune") {
+        ifstream positions(argv[2]);
+        tuneMode(positions);
+        return 0;
+    }
+    
+    if (argc > 3 && string(argv[1]) == "match") {
+        int games = (argc > 4) ? atoi(argv[4]) : 100;
+        int concurrency = (argc > 5) ? atoi(argv[5]) : max(std::thread::hardware_concurrency() / 2, 1u);
+        matchMode(argv[2], argv[3], games, max(concurrency, 1), (argc > 6) ? argv[6] : "");
+        return 0;
+    }
+    
+    if (argc > 2 && string(argv[1]) == "book") {
+        ifstream games(argv[2]);
+        int plies = (argc > 3) ? atoi(argv[3]) : BOOK_PLIES;
+        OpeningBook::build(games, plies, (argc > 4) ? argv[4] : BOOK_FILE);
+        return 0;
+    }
+    
+    if (book.load(BOOK_FILE)) {
+        cerr << "Opening book of " << book.size() << " moves" << endl;
+    }
+    if (tablebase.load(TB_FILE)) {
+        cerr << "Tablebase up to " << tablebase.pieces() << " pieces" << endl;
+    }
+    
+    if (argc > 2 && string(argv[1]) == "analyse") {
+        ifstream positions(argv[2]);
+        int depth = (argc > 3) ? atoi(argv[3]) : MAX_PLY - 1;
+        long long nodes = (argc > 4) ? atoll(argv[4]) : 0;
+        int threads = (argc > 5) ? atoi(argv[5]) : std::thread::hardware_concurrency();
+        analysisMode(positions, depth > 0 ? depth : MAX_PLY - 1, nodes, max(threads, 1));
+        return 0;
+    }
+    
+    if (argc > 1 && string(argv[1]) == "server") {
+        int threads = (argc > 2) ? atoi(argv[2]) : std::thread::hardware_concurrency();
+        serverMode(cin, max(threads, 1));
+        return 0;
+    }
+    
+    // game options : -t ms per move, -n nodes per move, -j threads, -p 0 to
+    // not ponder, -s file for the statistics
     unsigned int nthreads = std::thread::hardware_concurrency();
+    bool ponder = true;
+    double budget = MOVE_BUDGET;
+    long long nodeLimit = 0;
+    string statsFile;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        if (option == "-t") budget = atof(argv[i+1]);
+        else if (option == "-n") nodeLimit = atoll(argv[i+1]);
+        else if (option == "-j") nthreads = atoi(argv[i+1]);
+        else if (option == "-p") ponder = atoi(argv[i+1]) != 0;
+        else if (option == "-s") statsFile = argv[i+1];
+        else cerr << "Unknown option " << option << endl;
+    }
     
+    Game game;
+    game.clock().setBudget(budget, TIME_MARGIN);
+    game.clock().setNodeLimit(nodeLimit);
+    game.setPondering(ponder);
+    if (!statsFile.empty()) {
+        game.setStatsFile(statsFile);
+    }
     cerr << nthreads << " threads possible" << endl;
+    game.setThreads(nthreads);
+
+#ifdef TESTING_BOARD
     
+    game.testBoard();
+
+#else
     
     while(1) {
         game.updateBoard();
-        start = NOW;
+#ifdef PONDER
+        game.stopPondering();
+#endif
+        game.clock().start();
         game.printMove();
+#ifdef PONDER
+        game.startPondering();
+#endif
     }
     
 #endif